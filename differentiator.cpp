@@ -1,15 +1,402 @@
 #include "differentiator.hpp"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <mutex>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <system_error>
+#include <thread>
 #include <vector>
 
 #ifndef TESTING
-auto main(int argc, char *argv[]) -> int {
-  std::cout << "Running differentiator normally..." << '\n';
+namespace {
+
+// One axis of a --grid sweep: count evenly spaced points from start to stop
+// inclusive, given on the command line as var=start:stop:count.
+struct GridAxis {
+  std::string var;
+  double start = 0.0;
+  double stop = 0.0;
+  std::size_t count = 0;
+
+  double at(std::size_t i) const {
+    if (count == 1)
+      return start;
+    return start + (stop - start) * (double)i / (double)(count - 1);
+  }
+};
+
+auto invalidGrid(const std::string &spec) -> std::runtime_error {
+  return std::runtime_error("Invalid grid '" + spec +
+                            "', expected var=start:stop:count");
+}
+
+// Parses one numeric field of a grid spec; the whole field must be a number,
+// so "1e8" is not silently read as 1.
+template <typename Number>
+auto parseGridField(const std::string &field, const std::string &spec,
+                    Number (*convert)(const std::string &, std::size_t *))
+    -> Number {
+  std::size_t used = 0;
+  Number value{};
+  try {
+    value = convert(field, &used);
+  } catch (const std::logic_error &) {
+    throw invalidGrid(spec);
+  }
+  if (used != field.size()) {
+    throw invalidGrid(spec);
+  }
+  return value;
+}
+
+auto toDouble(const std::string &field, std::size_t *used) -> double {
+  return std::stod(field, used);
+}
+
+auto toLongLong(const std::string &field, std::size_t *used) -> long long {
+  return std::stoll(field, used);
+}
+
+auto parseGridAxis(const std::string &spec) -> GridAxis {
+  auto eq = spec.find('=');
+  auto colon1 = spec.find(':', eq == std::string::npos ? 0 : eq);
+  auto colon2 =
+      colon1 == std::string::npos ? colon1 : spec.find(':', colon1 + 1);
+  if (eq == std::string::npos || eq == 0 || colon2 == std::string::npos) {
+    throw invalidGrid(spec);
+  }
+  GridAxis axis;
+  axis.var = spec.substr(0, eq);
+  axis.start =
+      parseGridField(spec.substr(eq + 1, colon1 - eq - 1), spec, toDouble);
+  axis.stop = parseGridField(spec.substr(colon1 + 1, colon2 - colon1 - 1),
+                             spec, toDouble);
+  long long const count =
+      parseGridField(spec.substr(colon2 + 1), spec, toLongLong);
+  if (count <= 0) {
+    throw std::runtime_error("Grid point count must be positive: " + spec);
+  }
+  axis.count = static_cast<std::size_t>(count);
+  return axis;
+}
+
+// Upper bound for --threads; far more than any machine needs. The grid sweep
+// bounds its buffers by size, so a large count does not cost memory.
+constexpr unsigned maxThreadCount = 1024;
+
+// Parses a --threads value: a plain decimal count in [1, maxThreadCount].
+auto parseThreadCount(const std::string &text) -> std::optional<unsigned> {
+  unsigned count = 0;
+  const char *const end = text.data() + text.size();
+  auto const result = std::from_chars(text.data(), end, count);
+  if (text.empty() || result.ec != std::errc() || result.ptr != end ||
+      count == 0 || count > maxThreadCount) {
+    return std::nullopt;
+  }
+  return count;
+}
+
+// Evaluates an expression, and optionally its derivative, over the cartesian
+// product of the grid axes (last axis fastest). Worker threads evaluate and
+// format fixed-size chunks of points into a ring of output buffers while the
+// calling thread writes finished chunks to the file in order, so formatting
+// runs in parallel and I/O overlaps with evaluation.
+//
+// Points where evaluation fails (division by zero, ln of a non-positive
+// value) are written as NaN instead of aborting a partly written file.
+//
+// CSV rows hold the axis coordinates followed by the value and derivative.
+// Binary output holds only the value (and derivative) of each point as
+// little-endian doubles; the coordinates are implied by the grid.
+class GridSweep {
+public:
+  GridSweep(std::vector<GridAxis> gridAxes, CompiledExpression<double> value,
+            std::optional<CompiledExpression<double>> derivative, bool binary)
+      : axes(std::move(gridAxes)), value(std::move(value)),
+        derivative(std::move(derivative)), binary(binary) {
+    total = 1;
+    for (const auto &axis : axes) {
+      if (total > SIZE_MAX / axis.count) {
+        throw std::runtime_error("Grid has too many points");
+      }
+      total *= axis.count;
+    }
+    valueColumns = columnsFor(this->value);
+    if (this->derivative) {
+      derivativeColumns = columnsFor(*this->derivative);
+    }
+  }
+
+  void writeHeader(std::FILE *out, const std::string &diffVar) const {
+    if (binary)
+      return;
+    std::string header;
+    for (const auto &axis : axes) {
+      header += axis.var + ",";
+    }
+    header += "f";
+    if (derivative) {
+      header += ",df/d" + diffVar;
+    }
+    header += "\n";
+    writeAll(out, header.data(), header.size());
+  }
+
+  void run(std::FILE *out, unsigned threadCount) {
+    std::size_t const chunks = (total + chunkPoints - 1) / chunkPoints;
+    // Two slots per worker keep the writer busy, as long as the slots and
+    // the workers' scratch space fit in maxBufferBytes.
+    std::size_t const slotLimit =
+        std::max<std::size_t>(2, maxBufferBytes / chunkBytes());
+    std::size_t const ringSize = std::min(
+        2 * static_cast<std::size_t>(std::max(1u, threadCount)), slotLimit);
+    threadCount = static_cast<unsigned>(
+        std::min<std::size_t>(std::max(1u, threadCount), ringSize / 2));
+    std::vector<Slot> slots(ringSize);
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::atomic<std::size_t> nextChunk{0};
+    std::size_t nextWrite = 0;
+    bool failed = false;
+    std::exception_ptr error;
+
+    auto fail = [&](std::exception_ptr e) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!failed) {
+        failed = true;
+        error = e;
+      }
+      changed.notify_all();
+    };
+
+    auto worker = [&]() {
+      Scratch scratch;
+      for (;;) {
+        std::size_t const chunk = nextChunk++;
+        if (chunk >= chunks)
+          return;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          changed.wait(lock,
+                       [&] { return failed || chunk < nextWrite + ringSize; });
+          if (failed)
+            return;
+        }
+        Slot &slot = slots[chunk % ringSize];
+        try {
+          render(chunk, slot.data, scratch);
+        } catch (...) {
+          fail(std::current_exception());
+          return;
+        }
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          slot.ready = true;
+        }
+        changed.notify_all();
+      }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(threadCount);
+    for (unsigned t = 0; t < threadCount; ++t) {
+      workers.emplace_back(worker);
+    }
+
+    for (std::size_t chunk = 0; chunk < chunks; ++chunk) {
+      Slot &slot = slots[chunk % ringSize];
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return failed || slot.ready; });
+        if (failed)
+          break;
+      }
+      try {
+        writeAll(out, slot.data.data(), slot.data.size());
+      } catch (...) {
+        fail(std::current_exception());
+        break;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        slot.ready = false;
+        ++nextWrite;
+      }
+      changed.notify_all();
+    }
+
+    for (auto &t : workers) {
+      t.join();
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+private:
+  static constexpr std::size_t chunkPoints = std::size_t(1) << 16;
+  // Longest std::to_chars output for a double plus a separator.
+  static constexpr std::size_t maxNumberChars = 32;
+  // Memory budget for the output ring and the workers' scratch columns.
+  static constexpr std::size_t maxBufferBytes = std::size_t(256) << 20;
+
+  struct Slot {
+    std::vector<char> data;
+    bool ready = false;
+  };
+
+  struct Scratch {
+    std::vector<std::vector<double>> coords;
+    std::vector<double> values;
+    std::vector<double> derivatives;
+    EvalErrors errors;
+  };
+
+  std::vector<GridAxis> axes;
+  CompiledExpression<double> value;
+  std::optional<CompiledExpression<double>> derivative;
+  bool binary;
+  std::size_t total = 0;
+  std::vector<std::size_t> valueColumns;
+  std::vector<std::size_t> derivativeColumns;
+
+  // Maps each variable of the compiled expression to its grid axis.
+  auto columnsFor(const CompiledExpression<double> &compiled) const
+      -> std::vector<std::size_t> {
+    std::vector<std::size_t> columns;
+    for (const auto &var : compiled.variables()) {
+      auto it = std::find_if(axes.begin(), axes.end(), [&](const GridAxis &a) {
+        return a.var == var;
+      });
+      if (it == axes.end()) {
+        throw std::runtime_error("Missing value for variable: " + var);
+      }
+      columns.push_back(static_cast<std::size_t>(it - axes.begin()));
+    }
+    return columns;
+  }
+
+  // Largest output buffer of one chunk plus the scratch columns of the
+  // worker that renders it.
+  auto chunkBytes() const -> std::size_t {
+    std::size_t const perPoint = derivative ? 2 : 1;
+    std::size_t const output = binary
+                                   ? perPoint * sizeof(double)
+                                   : (axes.size() + perPoint) * maxNumberChars;
+    return chunkPoints * (output + (axes.size() + perPoint) * sizeof(double));
+  }
+
+  static void writeAll(std::FILE *out, const char *data, std::size_t size) {
+    if (size != 0 && std::fwrite(data, 1, size, out) != size) {
+      throw std::runtime_error("Failed to write grid output");
+    }
+  }
+
+  static auto hostIsLittleEndian() -> bool {
+    std::uint16_t const probe = 1;
+    unsigned char first = 0;
+    std::memcpy(&first, &probe, 1);
+    return first == 1;
+  }
+
+  static void evaluateInto(const CompiledExpression<double> &compiled,
+                           const std::vector<std::size_t> &columnAxes,
+                           Scratch &scratch, std::size_t n,
+                           std::vector<double> &out) {
+    std::vector<const double *> columns;
+    columns.reserve(columnAxes.size());
+    for (std::size_t axis : columnAxes) {
+      columns.push_back(scratch.coords[axis].data());
+    }
+    out.resize(n);
+    compiled.evaluateBatchNoThrow(columns, n, out.data(), scratch.errors,
+                                  std::numeric_limits<double>::quiet_NaN());
+  }
+
+  void render(std::size_t chunk, std::vector<char> &buffer,
+              Scratch &scratch) const {
+    std::size_t const first = chunk * chunkPoints;
+    std::size_t const n = std::min(chunkPoints, total - first);
+
+    // Walk the grid indices of the chunk like an odometer.
+    scratch.coords.resize(axes.size());
+    std::vector<std::size_t> index(axes.size());
+    std::size_t rest = first;
+    for (std::size_t k = axes.size(); k-- > 0;) {
+      index[k] = rest % axes[k].count;
+      rest /= axes[k].count;
+      scratch.coords[k].resize(n);
+    }
+    for (std::size_t i = 0; i < n; ++i) {
+      for (std::size_t k = 0; k < axes.size(); ++k) {
+        scratch.coords[k][i] = axes[k].at(index[k]);
+      }
+      for (std::size_t k = axes.size(); k-- > 0;) {
+        if (++index[k] < axes[k].count)
+          break;
+        index[k] = 0;
+      }
+    }
 
+    evaluateInto(value, valueColumns, scratch, n, scratch.values);
+    if (derivative) {
+      evaluateInto(*derivative, derivativeColumns, scratch, n,
+                   scratch.derivatives);
+    }
+
+    std::size_t const perPoint = derivative ? 2 : 1;
+    if (binary) {
+      buffer.resize(n * perPoint * sizeof(double));
+      char *p = buffer.data();
+      bool const swap = !hostIsLittleEndian();
+      for (std::size_t i = 0; i < n; ++i) {
+        for (std::size_t j = 0; j < perPoint; ++j) {
+          double const v = j == 0 ? scratch.values[i] : scratch.derivatives[i];
+          std::memcpy(p, &v, sizeof(double));
+          if (swap)
+            std::reverse(p, p + sizeof(double));
+          p += sizeof(double);
+        }
+      }
+      return;
+    }
+
+    buffer.resize(n * (axes.size() + perPoint) * maxNumberChars);
+    char *p = buffer.data();
+    char *const end = buffer.data() + buffer.size();
+    auto put = [&](double v, char separator) {
+      p = std::to_chars(p, end, v).ptr;
+      *p++ = separator;
+    };
+    for (std::size_t i = 0; i < n; ++i) {
+      for (std::size_t k = 0; k < axes.size(); ++k) {
+        put(scratch.coords[k][i], ',');
+      }
+      put(scratch.values[i], derivative ? ',' : '\n');
+      if (derivative) {
+        put(scratch.derivatives[i], '\n');
+      }
+    }
+    buffer.resize(static_cast<std::size_t>(p - buffer.data()));
+  }
+};
+
+} // namespace
+
+auto main(int argc, char *argv[]) -> int {
   std::vector<std::string> args;
   args.reserve(static_cast<std::size_t>(argc - 1)); 
   for (int i = 1; i < argc; i++) {
@@ -18,8 +405,13 @@ auto main(int argc, char *argv[]) -> int {
 
   bool doEval = false;
   bool doDiff = false;
+  bool sharedOutput = false;
   std::string expressionStr;
   std::string diffVar;
+  std::vector<std::string> gridSpecs;
+  std::string outputPath;
+  std::string format = "csv";
+  unsigned threadCount = std::thread::hardware_concurrency();
 
   for (size_t i = 0; i < args.size(); i++) {
     if (args[i] == "--eval") {
@@ -45,21 +437,121 @@ auto main(int argc, char *argv[]) -> int {
         std::cerr << "Error: --by requires a variable.\n";
         return 1;
       }
+    } else if (args[i] == "--shared") {
+      sharedOutput = true;
+    } else if (args[i] == "--grid") {
+      if (i + 1 < args.size()) {
+        gridSpecs.push_back(args[++i]);
+      } else {
+        std::cerr << "Error: --grid requires var=start:stop:count.\n";
+        return 1;
+      }
+    } else if (args[i] == "--output") {
+      if (i + 1 < args.size()) {
+        outputPath = args[++i];
+      } else {
+        std::cerr << "Error: --output requires a file name.\n";
+        return 1;
+      }
+    } else if (args[i] == "--format") {
+      if (i + 1 < args.size() &&
+          (args[i + 1] == "csv" || args[i + 1] == "binary")) {
+        format = args[++i];
+      } else {
+        std::cerr << "Error: --format must be csv or binary.\n";
+        return 1;
+      }
+    } else if (args[i] == "--threads") {
+      std::optional<unsigned> const count =
+          i + 1 < args.size() ? parseThreadCount(args[++i]) : std::nullopt;
+      if (!count) {
+        std::cerr << "Error: --threads requires a count from 1 to "
+                  << maxThreadCount << ".\n";
+        return 1;
+      }
+      threadCount = *count;
     }
   }
 
-  if ((doEval ^ doDiff) == 0) {
+  if ((doEval ^ doDiff) == 0 || (!gridSpecs.empty() && !doEval)) {
     std::cerr << "Usage:\n"
               << "  differentiator --eval \"expr\" x=val y=val ...\n"
-              << "  differentiator --diff \"expr\" --by var\n";
+              << "  differentiator --diff \"expr\" --by var [--shared]\n"
+              << "  differentiator --eval \"expr\" --grid x=start:stop:count"
+              << " [--grid ...] [--by var]\n"
+              << "                 [--format csv|binary] [--output file]"
+              << " [--threads n] [y=val ...]\n";
     return 1;
   }
 
+  // Grid output may go to stdout, so the banner is only printed otherwise.
+  if (gridSpecs.empty()) {
+    std::cout << "Running differentiator normally..." << '\n';
+  }
+
   try {
 
     using ExprD = Expression<double>;
 
-    if (doEval) {
+    if (doEval && !gridSpecs.empty()) {
+
+      ExprD expr = ExprD::parse(expressionStr);
+
+      std::vector<GridAxis> axes;
+      for (const auto &spec : gridSpecs) {
+        axes.push_back(parseGridAxis(spec));
+      }
+
+      // Bindings outside the grid are fixed before compiling, after the
+      // derivative is taken so that --by may name one of them.
+      std::map<std::string, double> fixed;
+      for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "--grid" || args[i] == "--output") {
+          i++;
+          continue;
+        }
+        auto pos = args[i].find('=');
+        if (pos != std::string::npos) {
+          fixed[args[i].substr(0, pos)] = std::stod(args[i].substr(pos + 1));
+        }
+      }
+      std::optional<CompiledExpression<double>> derivative;
+      if (!diffVar.empty()) {
+        derivative.emplace(expr.differentiate(diffVar).substitute(fixed));
+      }
+      expr = expr.substitute(fixed);
+      GridSweep sweep(std::move(axes), CompiledExpression<double>(expr),
+                      std::move(derivative), format == "binary");
+
+      std::FILE *out = stdout;
+      if (!outputPath.empty()) {
+        out = std::fopen(outputPath.c_str(), "wb");
+        if (out == nullptr) {
+          std::cerr << "Error: cannot open " << outputPath << "\n";
+          return 1;
+        }
+      }
+      std::vector<char> fileBuffer(std::size_t(1) << 22);
+      if (out != stdout) {
+        std::setvbuf(out, fileBuffer.data(), _IOFBF, fileBuffer.size());
+      }
+
+      try {
+        sweep.writeHeader(out, diffVar);
+        sweep.run(out, threadCount);
+      } catch (...) {
+        if (out != stdout)
+          std::fclose(out);
+        throw;
+      }
+      bool const closed =
+          out == stdout ? std::fflush(out) == 0 : std::fclose(out) == 0;
+      if (!closed) {
+        std::cerr << "Error: failed to write grid output\n";
+        return 1;
+      }
+
+    } else if (doEval) {
 
       ExprD const expr = ExprD::parse(expressionStr);
 
@@ -87,7 +579,9 @@ auto main(int argc, char *argv[]) -> int {
       }
 
       ExprD const derivative = expr.differentiate(diffVar);
-      std::cout << derivative.toString() << "\n";
+      std::cout << (sharedOutput ? derivative.toSharedString()
+                                 : derivative.toString())
+                << "\n";
     }
   } catch (const std::exception &e) {
     std::cerr << "Error: " << e.what() << "\n";
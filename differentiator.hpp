@@ -1,16 +1,33 @@
 #ifndef DIFFERENTIATOR_HPP
 #define DIFFERENTIATOR_HPP
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <complex>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include "simd_math.hpp"
+
 enum class ExprType {
   Constant,
   Variable,
@@ -26,6 +43,31 @@ enum class ExprType {
 };
 
 template <typename T> class Expression;
+template <typename T> class Polynomial;
+template <typename T> class CompiledExpression;
+
+// Each variable name hashes to one bit of a 64-bit mask. A node's mask is the
+// union of the bits of every variable below it, so a clear bit proves that the
+// subtree does not depend on that variable (a set bit may be a collision).
+inline std::uint64_t variableBit(const std::string &varName) {
+  return std::uint64_t(1) << (std::hash<std::string>{}(varName) & 63);
+}
+
+// Number of points in a batch of named columns. Only the columns of vars,
+// the variables the evaluator reads, count; a batch that reads none of them
+// takes its length from any column, or is a single point.
+template <typename T>
+std::size_t
+batchLength(const std::vector<std::string> &vars,
+            const std::map<std::string, std::vector<T>> &varColumns) {
+  for (const auto &var : vars) {
+    auto it = varColumns.find(var);
+    if (it != varColumns.end()) {
+      return it->second.size();
+    }
+  }
+  return varColumns.empty() ? 1 : varColumns.begin()->second.size();
+}
 
 template <typename T> struct ExprNode {
   ExprType type;
@@ -35,21 +77,271 @@ template <typename T> struct ExprNode {
   std::shared_ptr<ExprNode<T>> left;
   std::shared_ptr<ExprNode<T>> right;
 
+  std::uint64_t varMask;
+  // Number of nodes in the subtree, counting shared subtrees once per
+  // reference and saturating instead of overflowing.
+  std::uint64_t size;
+
   ExprNode(ExprType t, const T &val)
-      : type(t), value(val), left(nullptr), right(nullptr) {}
+      : type(t), value(val), left(nullptr), right(nullptr), varMask(0),
+        size(1) {}
 
   ExprNode(ExprType t, const std::string &var)
-      : type(t), varName(var), left(nullptr), right(nullptr) {}
+      : type(t), varName(var), left(nullptr), right(nullptr),
+        varMask(variableBit(var)), size(1) {}
 
   ExprNode(ExprType t, std::shared_ptr<ExprNode<T>> l,
            std::shared_ptr<ExprNode<T>> r)
-      : type(t), left(l), right(r) {}
+      : type(t), left(l), right(r),
+        varMask((l ? l->varMask : 0) | (r ? r->varMask : 0)),
+        size(subtreeSize(l, r)) {}
+
+  bool mayDependOn(std::uint64_t bit) const { return (varMask & bit) != 0; }
+
+  // Only a node with more than one owner can be reached twice in a single
+  // traversal, so only such nodes are worth memoising.
+  static bool isShared(const std::shared_ptr<ExprNode<T>> &node) {
+    return node.use_count() > 1;
+  }
+
+  static std::uint64_t subtreeSize(const std::shared_ptr<ExprNode<T>> &l,
+                                   const std::shared_ptr<ExprNode<T>> &r) {
+    const std::uint64_t limit = std::numeric_limits<std::uint64_t>::max();
+    std::uint64_t a = l ? l->size : 0;
+    std::uint64_t b = r ? r->size : 0;
+    return a >= limit - 1 - b ? limit : a + b + 1;
+  }
+};
+
+// Work-stealing thread pool for fork-join recursion over expression trees.
+// Every worker owns a deque: it pushes and pops its own forked tasks at the
+// back while idle workers steal from the front. A worker waiting in a join
+// runs other queued tasks before it blocks, so nested forkJoin calls cannot
+// deadlock. Subtrees with fewer than grain() nodes are processed
+// sequentially by the Expression methods that take a pool.
+class ForkJoinPool {
+public:
+  static constexpr std::size_t defaultGrain = 4096;
+  // Failed steal attempts before a join blocks instead of yielding.
+  static constexpr unsigned joinSpins = 64;
+
+  explicit ForkJoinPool(unsigned threads = std::thread::hardware_concurrency(),
+                        std::size_t grain = defaultGrain)
+      : grainSize(std::max<std::size_t>(grain, 2)),
+        queues(std::max(threads, 1u) + 1) {
+    unsigned count = std::max(threads, 1u);
+    workers.reserve(count);
+    for (unsigned i = 0; i < count; ++i) {
+      workers.emplace_back([this, i] { workerLoop(i); });
+    }
+  }
+
+  ForkJoinPool(const ForkJoinPool &) = delete;
+  ForkJoinPool &operator=(const ForkJoinPool &) = delete;
+
+  ~ForkJoinPool() {
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      stopping = true;
+    }
+    sleepCv.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  unsigned threadCount() const { return (unsigned)workers.size(); }
+  std::size_t grain() const { return grainSize; }
+
+  // Index of the calling worker thread in [0, threadCount()); only
+  // meaningful inside run().
+  unsigned workerIndex() const { return currentIndex; }
+
+  // Runs f on a worker thread and waits for it, rethrowing its exception.
+  // Called from inside one of this pool's workers, f simply runs inline.
+  template <typename F> void run(F &&f) {
+    if (currentPool == this) {
+      f();
+      return;
+    }
+    CallJob<F> job(f);
+    job.external = true;
+    push(job, threadCount());
+    {
+      std::unique_lock<std::mutex> lock(sleepMutex);
+      doneCv.wait(lock, [&] { return job.done.load(); });
+    }
+    if (job.error) {
+      std::rethrow_exception(job.error);
+    }
+  }
+
+  // Runs a and b, possibly in parallel, and returns once both have finished.
+  // If either throws, the exception from a takes precedence over the one
+  // from b. Outside run() both calls happen sequentially on this thread.
+  template <typename A, typename B> void forkJoin(A &&a, B &&b) {
+    if (currentPool != this) {
+      a();
+      b();
+      return;
+    }
+    CallJob<A> forked(a);
+    push(forked, currentIndex);
+    std::exception_ptr bError;
+    try {
+      b();
+    } catch (...) {
+      bError = std::current_exception();
+    }
+    // Help with queued work while the forked half runs elsewhere; once there
+    // has been nothing to steal for a while, sleep until the forked half
+    // finishes or new work is pushed.
+    unsigned idle = 0;
+    while (!forked.done.load()) {
+      if (Job *other = findWork(currentIndex)) {
+        finish(other);
+        idle = 0;
+      } else if (++idle < joinSpins) {
+        std::this_thread::yield();
+      } else {
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        ++joinWaiters;
+        sleepCv.wait(lock,
+                     [&] { return forked.done.load() || pending.load() > 0; });
+        --joinWaiters;
+        idle = 0;
+      }
+    }
+    if (forked.error) {
+      std::rethrow_exception(forked.error);
+    }
+    if (bError) {
+      std::rethrow_exception(bError);
+    }
+  }
+
+private:
+  struct Job {
+    virtual ~Job() = default;
+    virtual void call() = 0;
+
+    void execute() {
+      try {
+        call();
+      } catch (...) {
+        error = std::current_exception();
+      }
+      done.store(true);
+    }
+
+    std::atomic<bool> done{false};
+    std::exception_ptr error;
+    bool external = false;
+  };
+
+  template <typename F> struct CallJob : Job {
+    explicit CallJob(F &f) : fn(f) {}
+    void call() override { fn(); }
+    F &fn;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Job *> jobs;
+  };
+
+  // Queue threadCount() receives the root tasks submitted by run().
+  void push(Job &job, unsigned queue) {
+    {
+      std::lock_guard<std::mutex> lock(queues[queue].mutex);
+      queues[queue].jobs.push_back(&job);
+    }
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      ++pending;
+    }
+    sleepCv.notify_one();
+  }
+
+  Job *findWork(unsigned self) {
+    {
+      Queue &own = queues[self];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.jobs.empty()) {
+        Job *job = own.jobs.back();
+        own.jobs.pop_back();
+        --pending;
+        return job;
+      }
+    }
+    for (std::size_t k = 1; k < queues.size(); ++k) {
+      Queue &victim = queues[(self + k) % queues.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.jobs.empty()) {
+        Job *job = victim.jobs.front();
+        victim.jobs.pop_front();
+        --pending;
+        return job;
+      }
+    }
+    return nullptr;
+  }
+
+  // Runs a job taken from a queue and wakes whoever may be waiting for it.
+  // The waiting thread may destroy the job as soon as it sees done, so the
+  // job is not touched after execute().
+  void finish(Job *job) {
+    bool external = job->external;
+    job->execute();
+    if (external) {
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      doneCv.notify_all();
+    } else if (joinWaiters.load() > 0) {
+      {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+      }
+      sleepCv.notify_all();
+    }
+  }
+
+  void workerLoop(unsigned index) {
+    currentPool = this;
+    currentIndex = index;
+    for (;;) {
+      if (Job *job = findWork(index)) {
+        finish(job);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleepMutex);
+      sleepCv.wait(lock, [&] { return stopping || pending.load() > 0; });
+      if (stopping) {
+        return;
+      }
+    }
+  }
+
+  inline static thread_local ForkJoinPool *currentPool = nullptr;
+  inline static thread_local unsigned currentIndex = 0;
+
+  std::size_t grainSize;
+  std::vector<Queue> queues;
+  std::vector<std::thread> workers;
+  std::atomic<std::size_t> pending{0};
+  // Joins blocked on sleepCv rather than spinning.
+  std::atomic<unsigned> joinWaiters{0};
+  std::mutex sleepMutex;
+  std::condition_variable sleepCv;
+  std::condition_variable doneCv;
+  bool stopping = false;
 };
 
 template <typename T> class Expression {
 private:
   std::shared_ptr<ExprNode<T>> root;
 
+  friend class Polynomial<T>;
+  friend class CompiledExpression<T>;
+
 public:
   Expression() : root(nullptr) {}
 
@@ -142,15 +434,96 @@ public:
 
   std::string toString() const { return toStringImpl(root); }
 
+  // Prints the expression as a DAG: every operator node reached through
+  // more than one reference is bound once to a numbered temporary, e.g.
+  //   t1 = sin(x);
+  //   result = (t1 * t1);
+  // The output grows with the number of distinct nodes rather than with the
+  // size of the fully expanded tree that toString() prints.
+  std::string toSharedString() const {
+    SharedPrinter printer;
+    printer.countReferences(root);
+    std::string body;
+    printer.write(root, body);
+    return printer.bindings + "result = " + body;
+  }
+
   Expression<T> substitute(const std::string &varName, const T &val) const {
-    auto newRoot = substituteImpl(root, varName, val);
-    return Expression<T>(newRoot);
+    return substitute(std::map<std::string, T>{{varName, val}});
+  }
+
+  // Replaces every variable named in bindings by its value in one pass.
+  // Subtrees that mention none of the bound variables are shared with this
+  // expression instead of copied, and every operator whose operands end up
+  // numeric is folded to a constant. Operations that would throw when
+  // evaluated (such as 1/0) are kept so that evaluate() still reports them.
+  Expression<T> substitute(const std::map<std::string, T> &bindings) const {
+    SubstituteContext ctx{bindings, 0, {}};
+    for (const auto &binding : bindings) {
+      ctx.mask |= variableBit(binding.first);
+    }
+    return Expression<T>(substituteImpl(root, ctx));
   }
 
   T evaluate(const std::map<std::string, T> &varValues = {}) const {
     return evaluateImpl(root, varValues);
   }
 
+  // Fork-join versions of differentiate(), substitute() and evaluate() for
+  // very large expressions. Subtrees with at least pool.grain() nodes are
+  // split into parallel tasks whatever their shape, so long parsed or
+  // left-folded chains benefit as well as balanced trees; smaller subtrees
+  // go through the sequential code. The results, including which exception
+  // evaluate() throws, are the same as the sequential versions'.
+  Expression<T> differentiate(const std::string &varName,
+                              ForkJoinPool &pool) const {
+    std::vector<DiffMemo> workerMemos(pool.threadCount());
+    ConcurrentMemo shared;
+    ParallelDiff recurse{varName, variableBit(varName), pool, workerMemos,
+                         shared};
+    std::shared_ptr<ExprNode<T>> diffRoot;
+    pool.run([&] {
+      Outcome<std::shared_ptr<ExprNode<T>>> outcome;
+      traverse(root, recurse, pool, outcome);
+      diffRoot = valueOf(outcome);
+    });
+    return Expression<T>(diffRoot);
+  }
+
+  Expression<T> substitute(const std::map<std::string, T> &bindings,
+                           ForkJoinPool &pool) const {
+    std::uint64_t mask = 0;
+    for (const auto &binding : bindings) {
+      mask |= variableBit(binding.first);
+    }
+    std::vector<SubstituteContext> workerContexts;
+    workerContexts.reserve(pool.threadCount());
+    for (unsigned i = 0; i < pool.threadCount(); ++i) {
+      workerContexts.push_back(SubstituteContext{bindings, mask, {}});
+    }
+    ConcurrentMemo shared;
+    ParallelSubstitute recurse{mask, pool, workerContexts, shared};
+    std::shared_ptr<ExprNode<T>> newRoot;
+    pool.run([&] {
+      Outcome<std::shared_ptr<ExprNode<T>>> outcome;
+      traverse(root, recurse, pool, outcome);
+      newRoot = valueOf(outcome);
+    });
+    return Expression<T>(newRoot);
+  }
+
+  T evaluate(const std::map<std::string, T> &varValues,
+             ForkJoinPool &pool) const {
+    T result{};
+    ParallelEval recurse{varValues};
+    pool.run([&] {
+      Outcome<T> outcome;
+      traverse(root, recurse, pool, outcome);
+      result = valueOf(outcome);
+    });
+    return result;
+  }
+
   static Expression<T> parse(const std::string &exprStr) {
     std::string s = trim(exprStr);
     if (s.empty()) {
@@ -272,10 +645,39 @@ public:
   }
 
   Expression<T> differentiate(const std::string &varName) const {
-    auto diffRoot = differentiateImpl(root, varName);
+    DiffMemo memo;
+    auto diffRoot =
+        differentiateImpl(root, varName, variableBit(varName), memo);
     return Expression<T>(diffRoot);
   }
 
+  // Taylor coefficients c_0..c_order of the expression in varName around
+  // point, with the other variables fixed by varValues. Coefficient arrays
+  // are propagated through the tree with the usual series recurrences, so
+  // the cost is O(order^2) per node and no derivative trees are built.
+  std::vector<T>
+  taylorCoefficients(const std::string &varName, const T &point,
+                     std::size_t order,
+                     const std::map<std::string, T> &varValues = {}) const {
+    TaylorContext ctx{varName, variableBit(varName), order, varValues, {}, {}};
+    ctx.varValues[varName] = point;
+    return taylorImpl(root, ctx);
+  }
+
+  // Derivatives f, f', ..., f^(order) with respect to varName at point.
+  std::vector<T>
+  taylorDerivatives(const std::string &varName, const T &point,
+                    std::size_t order,
+                    const std::map<std::string, T> &varValues = {}) const {
+    std::vector<T> d = taylorCoefficients(varName, point, order, varValues);
+    T factorial = (T)1;
+    for (std::size_t k = 1; k < d.size(); ++k) {
+      factorial *= (T)k;
+      d[k] *= factorial;
+    }
+    return d;
+  }
+
 private:
   template <typename U> static U stringToValue(const std::string &s) {
     std::stringstream ss(s);
@@ -384,25 +786,203 @@ private:
     return "";
   }
 
+  struct SharedPrinter {
+    std::unordered_map<const ExprNode<T> *, std::size_t> references;
+    std::unordered_map<const ExprNode<T> *, std::string> names;
+    std::unordered_set<std::string> variables;
+    std::size_t nextIndex = 1;
+    std::string bindings;
+
+    void countReferences(const std::shared_ptr<ExprNode<T>> &node) {
+      if (!node)
+        return;
+      if (references[node.get()]++ > 0)
+        return;
+      if (node->type == ExprType::Variable)
+        variables.insert(node->varName);
+      countReferences(node->left);
+      countReferences(node->right);
+    }
+
+    void write(const std::shared_ptr<ExprNode<T>> &node, std::string &out) {
+      if (!node)
+        return;
+      bool leaf =
+          node->type == ExprType::Constant || node->type == ExprType::Variable;
+      if (leaf || references[node.get()] < 2) {
+        writeNode(node, out);
+        return;
+      }
+      auto named = names.find(node.get());
+      if (named == names.end()) {
+        std::string definition;
+        writeNode(node, definition);
+        std::string name = freshName();
+        bindings += name + " = " + definition + ";\n";
+        named = names.emplace(node.get(), name).first;
+      }
+      out += named->second;
+    }
+
+    // Temporaries are t1, t2, ..., skipping names of the expression's own
+    // variables so that every binding is unambiguous.
+    std::string freshName() {
+      std::string name;
+      do {
+        name = "t" + std::to_string(nextIndex++);
+      } while (variables.count(name));
+      return name;
+    }
+
+    void writeNode(const std::shared_ptr<ExprNode<T>> &node,
+                   std::string &out) {
+      const char *open = "(";
+      const char *op = nullptr;
+      switch (node->type) {
+      case ExprType::Constant: {
+        std::ostringstream oss;
+        oss << node->value;
+        out += oss.str();
+        return;
+      }
+      case ExprType::Variable:
+        out += node->varName;
+        return;
+      case ExprType::Add:
+        op = " + ";
+        break;
+      case ExprType::Sub:
+        op = " - ";
+        break;
+      case ExprType::Mul:
+        op = " * ";
+        break;
+      case ExprType::Div:
+        op = " / ";
+        break;
+      case ExprType::Pow:
+        op = "^";
+        break;
+      case ExprType::Sin:
+        open = "sin(";
+        break;
+      case ExprType::Cos:
+        open = "cos(";
+        break;
+      case ExprType::Ln:
+        open = "ln(";
+        break;
+      case ExprType::Exp:
+        open = "exp(";
+        break;
+      }
+      out += open;
+      write(node->left, out);
+      if (op) {
+        out += op;
+        write(node->right, out);
+      }
+      out += ")";
+    }
+  };
+
+  struct SubstituteContext {
+    const std::map<std::string, T> &bindings;
+    std::uint64_t mask;
+    std::unordered_map<const ExprNode<T> *, std::shared_ptr<ExprNode<T>>> memo;
+  };
+
   static std::shared_ptr<ExprNode<T>>
   substituteImpl(const std::shared_ptr<ExprNode<T>> &node,
-                 const std::string &varName, const T &val) {
+                 SubstituteContext &ctx) {
     if (!node)
       return nullptr;
 
-    if (node->type == ExprType::Variable && node->varName == varName) {
+    // Untouched subtrees that still contain variables are shared as-is.
+    if (node->varMask != 0 && !node->mayDependOn(ctx.mask))
+      return node;
+
+    // Only nodes with several owners can be reached again, and a leaf is
+    // cheaper to redo than to look up.
+    bool shared = node->left && ExprNode<T>::isShared(node);
+    if (shared) {
+      auto found = ctx.memo.find(node.get());
+      if (found != ctx.memo.end())
+        return found->second;
+    }
 
-      return std::make_shared<ExprNode<T>>(ExprType::Constant, val);
+    std::shared_ptr<ExprNode<T>> result;
+    if (node->type == ExprType::Variable) {
+      auto it = ctx.bindings.find(node->varName);
+      result = it == ctx.bindings.end()
+                   ? node
+                   : std::make_shared<ExprNode<T>>(ExprType::Constant,
+                                                   it->second);
+    } else if (node->type == ExprType::Constant) {
+      result = node;
+    } else {
+      result = rebuild(node, substituteImpl(node->left, ctx),
+                       substituteImpl(node->right, ctx));
     }
+    if (shared)
+      ctx.memo.emplace(node.get(), result);
+    return result;
+  }
 
-    auto newNode = std::make_shared<ExprNode<T>>(*node);
-    newNode->left = substituteImpl(node->left, varName, val);
-    newNode->right = substituteImpl(node->right, varName, val);
-    return newNode;
+  // node with its operands replaced by l and r, sharing node when they are
+  // unchanged. An operator whose operands are all constants is folded;
+  // operations that would throw are left in place for evaluate() to report.
+  static std::shared_ptr<ExprNode<T>>
+  rebuild(const std::shared_ptr<ExprNode<T>> &node,
+          std::shared_ptr<ExprNode<T>> l, std::shared_ptr<ExprNode<T>> r) {
+    bool foldable = l && l->type == ExprType::Constant &&
+                    (!r || r->type == ExprType::Constant);
+    std::shared_ptr<ExprNode<T>> result =
+        (l == node->left && r == node->right)
+            ? node
+            : std::make_shared<ExprNode<T>>(node->type, std::move(l),
+                                            std::move(r));
+    if (!foldable)
+      return result;
+    try {
+      return makeConstant(evaluateImpl(result, {}));
+    } catch (const std::runtime_error &) {
+      return result;
+    }
   }
 
   static T evaluateImpl(const std::shared_ptr<ExprNode<T>> &node,
                         const std::map<std::string, T> &varValues) {
+    return evaluateNode(node, varValues, SequentialEval{varValues});
+  }
+
+  struct NoCheck {
+    void operator()(const T &) const {}
+  };
+
+  // children(a, b, check) evaluates a, passes its value to check, then
+  // evaluates b; an exception from a, then from check, wins over one from b.
+  struct SequentialEval {
+    const std::map<std::string, T> &varValues;
+
+    T child(const std::shared_ptr<ExprNode<T>> &node) const {
+      return evaluateImpl(node, varValues);
+    }
+
+    template <typename Check>
+    std::pair<T, T> children(const std::shared_ptr<ExprNode<T>> &a,
+                             const std::shared_ptr<ExprNode<T>> &b,
+                             Check check) const {
+      T x = child(a);
+      check(x);
+      return {x, child(b)};
+    }
+  };
+
+  template <typename Recurse>
+  static T evaluateNode(const std::shared_ptr<ExprNode<T>> &node,
+                        const std::map<std::string, T> &varValues,
+                        const Recurse &recurse) {
     if (!node) {
       throw std::runtime_error("Cannot evaluate an empty node");
     }
@@ -420,42 +1000,43 @@ private:
       return it->second;
     }
 
-    case ExprType::Add:
-      return evaluateImpl(node->left, varValues) +
-             evaluateImpl(node->right, varValues);
+    case ExprType::Add: {
+      auto v = recurse.children(node->left, node->right, NoCheck{});
+      return v.first + v.second;
+    }
 
-    case ExprType::Sub:
-      return evaluateImpl(node->left, varValues) -
-             evaluateImpl(node->right, varValues);
+    case ExprType::Sub: {
+      auto v = recurse.children(node->left, node->right, NoCheck{});
+      return v.first - v.second;
+    }
 
-    case ExprType::Mul:
-      return evaluateImpl(node->left, varValues) *
-             evaluateImpl(node->right, varValues);
+    case ExprType::Mul: {
+      auto v = recurse.children(node->left, node->right, NoCheck{});
+      return v.first * v.second;
+    }
 
     case ExprType::Div: {
-      T denominator = evaluateImpl(node->right, varValues);
-      if (std::fabs(denominator) < 1e-15) {
-        throw std::runtime_error("Division by zero");
-      }
-      T numerator = evaluateImpl(node->left, varValues);
-      return numerator / denominator;
+      auto v = recurse.children(node->right, node->left, [](const T &denom) {
+        if (std::fabs(denom) < 1e-15) {
+          throw std::runtime_error("Division by zero");
+        }
+      });
+      return v.second / v.first;
     }
 
     case ExprType::Pow: {
-      T base = evaluateImpl(node->left, varValues);
-      T exponent = evaluateImpl(node->right, varValues);
-
-      return std::pow(base, exponent);
+      auto v = recurse.children(node->left, node->right, NoCheck{});
+      return std::pow(v.first, v.second);
     }
 
     case ExprType::Sin:
-      return std::sin(evaluateImpl(node->left, varValues));
+      return std::sin(recurse.child(node->left));
 
     case ExprType::Cos:
-      return std::cos(evaluateImpl(node->left, varValues));
+      return std::cos(recurse.child(node->left));
 
     case ExprType::Ln: {
-      T arg = evaluateImpl(node->left, varValues);
+      T arg = recurse.child(node->left);
       if (arg <= (T)0) {
         throw std::runtime_error("ln domain error: argument <= 0");
       }
@@ -463,66 +1044,356 @@ private:
     }
 
     case ExprType::Exp:
-      return std::exp(evaluateImpl(node->left, varValues));
+      return std::exp(recurse.child(node->left));
     }
     throw std::runtime_error("Unknown expression type in evaluateImpl()");
   }
 
+  using Series = std::vector<T>;
+
+  struct TaylorContext {
+    std::string varName;
+    std::uint64_t varBit;
+    std::size_t order;
+    std::map<std::string, T> varValues;
+    std::unordered_map<const ExprNode<T> *, Series> memo;
+    std::unordered_map<const ExprNode<T> *, std::pair<Series, Series>> sinCos;
+  };
+
+  static Series seriesProduct(const Series &a, const Series &b) {
+    Series c(a.size(), (T)0);
+    for (std::size_t k = 0; k < c.size(); ++k) {
+      for (std::size_t j = 0; j <= k; ++j) {
+        c[k] += a[j] * b[k - j];
+      }
+    }
+    return c;
+  }
+
+  static Series seriesExp(const Series &u) {
+    Series e(u.size(), (T)0);
+    e[0] = std::exp(u[0]);
+    for (std::size_t k = 1; k < e.size(); ++k) {
+      T sum = (T)0;
+      for (std::size_t j = 1; j <= k; ++j) {
+        sum += (T)j * u[j] * e[k - j];
+      }
+      e[k] = sum / (T)k;
+    }
+    return e;
+  }
+
+  static Series seriesLn(const Series &u) {
+    if (u[0] <= (T)0) {
+      throw std::runtime_error("ln domain error: argument <= 0");
+    }
+    Series l(u.size(), (T)0);
+    l[0] = std::log(u[0]);
+    for (std::size_t k = 1; k < l.size(); ++k) {
+      T sum = (T)0;
+      for (std::size_t j = 1; j < k; ++j) {
+        sum += (T)j * l[j] * u[k - j];
+      }
+      l[k] = (u[k] - sum / (T)k) / u[0];
+    }
+    return l;
+  }
+
+  // u^r for an exponent r that does not depend on the expansion variable.
+  static Series seriesPow(const Series &u, const T &r) {
+    Series p(u.size(), (T)0);
+    if (u[0] != (T)0) {
+      p[0] = std::pow(u[0], r);
+      for (std::size_t k = 1; k < p.size(); ++k) {
+        T sum = (T)0;
+        for (std::size_t j = 1; j <= k; ++j) {
+          sum += (r * (T)j - (T)(k - j)) * u[j] * p[k - j];
+        }
+        p[k] = sum / ((T)k * u[0]);
+      }
+      return p;
+    }
+    if (r < (T)0 || r != std::floor(r)) {
+      throw std::runtime_error(
+          "Taylor expansion of u^r needs u != 0 unless r is a "
+          "non-negative integer");
+    }
+    // u = u_1 t + ..., so u^r starts at t^r: past the order it is all zeros,
+    // and otherwise r is small enough to drive square-and-multiply (the
+    // recurrence above divides by u_0).
+    if (r > (T)(u.size() - 1))
+      return p;
+    p[0] = (T)1;
+    Series square = u;
+    for (unsigned long long n = (unsigned long long)r; n; n >>= 1) {
+      if (n & 1ull)
+        p = seriesProduct(p, square);
+      if (n > 1)
+        square = seriesProduct(square, square);
+    }
+    return p;
+  }
+
+  static const std::pair<Series, Series> &
+  seriesSinCos(const std::shared_ptr<ExprNode<T>> &arg, TaylorContext &ctx) {
+    auto found = ctx.sinCos.find(arg.get());
+    if (found != ctx.sinCos.end())
+      return found->second;
+    Series u = taylorImpl(arg, ctx);
+    Series s(u.size(), (T)0), c(u.size(), (T)0);
+    s[0] = std::sin(u[0]);
+    c[0] = std::cos(u[0]);
+    for (std::size_t k = 1; k < u.size(); ++k) {
+      T sumS = (T)0, sumC = (T)0;
+      for (std::size_t j = 1; j <= k; ++j) {
+        sumS += (T)j * u[j] * c[k - j];
+        sumC += (T)j * u[j] * s[k - j];
+      }
+      s[k] = sumS / (T)k;
+      c[k] = -sumC / (T)k;
+    }
+    return ctx.sinCos.emplace(arg.get(), std::make_pair(s, c)).first->second;
+  }
+
+  static Series taylorImpl(const std::shared_ptr<ExprNode<T>> &node,
+                           TaylorContext &ctx) {
+    if (!node) {
+      throw std::runtime_error("Cannot evaluate an empty node");
+    }
+    auto found = ctx.memo.find(node.get());
+    if (found != ctx.memo.end())
+      return found->second;
+
+    Series out(ctx.order + 1, (T)0);
+    if (!node->mayDependOn(ctx.varBit)) {
+      out[0] = evaluateImpl(node, ctx.varValues);
+      return ctx.memo.emplace(node.get(), out).first->second;
+    }
+
+    switch (node->type) {
+    case ExprType::Constant:
+      out[0] = node->value;
+      break;
+
+    case ExprType::Variable:
+      out[0] = evaluateImpl(node, ctx.varValues);
+      if (node->varName == ctx.varName && ctx.order > 0)
+        out[1] = (T)1;
+      break;
+
+    case ExprType::Add:
+    case ExprType::Sub: {
+      Series a = taylorImpl(node->left, ctx);
+      Series b = taylorImpl(node->right, ctx);
+      for (std::size_t k = 0; k < out.size(); ++k)
+        out[k] = node->type == ExprType::Add ? a[k] + b[k] : a[k] - b[k];
+      break;
+    }
+
+    case ExprType::Mul:
+      out = seriesProduct(taylorImpl(node->left, ctx),
+                          taylorImpl(node->right, ctx));
+      break;
+
+    case ExprType::Div: {
+      Series b = taylorImpl(node->right, ctx);
+      if (std::fabs(b[0]) < 1e-15) {
+        throw std::runtime_error("Division by zero");
+      }
+      Series a = taylorImpl(node->left, ctx);
+      for (std::size_t k = 0; k < out.size(); ++k) {
+        T sum = a[k];
+        for (std::size_t j = 1; j <= k; ++j)
+          sum -= b[j] * out[k - j];
+        out[k] = sum / b[0];
+      }
+      break;
+    }
+
+    case ExprType::Pow: {
+      Series u = taylorImpl(node->left, ctx);
+      if (!node->right->mayDependOn(ctx.varBit)) {
+        out = seriesPow(u, evaluateImpl(node->right, ctx.varValues));
+      } else {
+        out = seriesExp(
+            seriesProduct(taylorImpl(node->right, ctx), seriesLn(u)));
+      }
+      break;
+    }
+
+    case ExprType::Sin:
+      out = seriesSinCos(node->left, ctx).first;
+      break;
+
+    case ExprType::Cos:
+      out = seriesSinCos(node->left, ctx).second;
+      break;
+
+    case ExprType::Ln:
+      out = seriesLn(taylorImpl(node->left, ctx));
+      break;
+
+    case ExprType::Exp:
+      out = seriesExp(taylorImpl(node->left, ctx));
+      break;
+    }
+    return ctx.memo.emplace(node.get(), std::move(out)).first->second;
+  }
+
+  static std::shared_ptr<ExprNode<T>>
+  makeConstant(const T &val) {
+    return std::make_shared<ExprNode<T>>(ExprType::Constant, val);
+  }
+
+  using DiffMemo =
+      std::unordered_map<const ExprNode<T> *, std::shared_ptr<ExprNode<T>>>;
+
+  // Each shared node is differentiated once per call, so a subtree shared
+  // by pointer has a single, shared derivative. Nodes of a plain tree skip
+  // the memo, and so do leaves, which are cheaper to redo than to look up.
   static std::shared_ptr<ExprNode<T>>
   differentiateImpl(const std::shared_ptr<ExprNode<T>> &node,
-                    const std::string &varName) {
+                    const std::string &varName, std::uint64_t varBit,
+                    DiffMemo &memo) {
     if (!node)
       return nullptr;
+    if (!node->left || !ExprNode<T>::isShared(node))
+      return differentiateNode(node, varName, varBit,
+                               SequentialDiff{varName, varBit, memo});
+    auto found = memo.find(node.get());
+    if (found != memo.end())
+      return found->second;
+    auto diff = differentiateNode(node, varName, varBit,
+                                  SequentialDiff{varName, varBit, memo});
+    memo.emplace(node.get(), diff);
+    return diff;
+  }
+
+  struct SequentialDiff {
+    const std::string &varName;
+    std::uint64_t varBit;
+    DiffMemo &memo;
+
+    std::shared_ptr<ExprNode<T>>
+    child(const std::shared_ptr<ExprNode<T>> &node) const {
+      return differentiateImpl(node, varName, varBit, memo);
+    }
+
+    std::pair<std::shared_ptr<ExprNode<T>>, std::shared_ptr<ExprNode<T>>>
+    children(const std::shared_ptr<ExprNode<T>> &a,
+             const std::shared_ptr<ExprNode<T>> &b) const {
+      auto da = child(a);
+      return {da, child(b)};
+    }
+  };
+
+  // Subtrees whose variable mask excludes varBit are constant with respect to
+  // the variable: they differentiate to zero without being visited, and the
+  // product, quotient and power rules below drop the terms they would zero.
+  // The recursion goes through recurse.child() and recurse.children() so
+  // that the same rules serve the sequential and the fork-join traversal.
+  template <typename Recurse>
+  static std::shared_ptr<ExprNode<T>>
+  differentiateNode(const std::shared_ptr<ExprNode<T>> &node,
+                    const std::string &varName, std::uint64_t varBit,
+                    const Recurse &recurse) {
+
+    if (!node->mayDependOn(varBit)) {
+      return makeConstant((T)0);
+    }
+
+    auto dependsOn = [&](const std::shared_ptr<ExprNode<T>> &child) {
+      return child && child->mayDependOn(varBit);
+    };
 
     switch (node->type) {
     case ExprType::Constant:
 
-      return std::make_shared<ExprNode<T>>(ExprType::Constant, (T)0);
+      return makeConstant((T)0);
 
     case ExprType::Variable:
 
       if (node->varName == varName) {
-        return std::make_shared<ExprNode<T>>(ExprType::Constant, (T)1);
+        return makeConstant((T)1);
       } else {
-        return std::make_shared<ExprNode<T>>(ExprType::Constant, (T)0);
+        return makeConstant((T)0);
       }
 
     case ExprType::Add: {
 
-      auto leftDiff = differentiateImpl(node->left, varName);
-      auto rightDiff = differentiateImpl(node->right, varName);
-      return std::make_shared<ExprNode<T>>(ExprType::Add, leftDiff, rightDiff);
+      if (!dependsOn(node->left)) {
+        return recurse.child(node->right);
+      }
+      if (!dependsOn(node->right)) {
+        return recurse.child(node->left);
+      }
+      auto diffs = recurse.children(node->left, node->right);
+      return std::make_shared<ExprNode<T>>(ExprType::Add, diffs.first,
+                                           diffs.second);
     }
     case ExprType::Sub: {
 
-      auto leftDiff = differentiateImpl(node->left, varName);
-      auto rightDiff = differentiateImpl(node->right, varName);
-      return std::make_shared<ExprNode<T>>(ExprType::Sub, leftDiff, rightDiff);
+      if (!dependsOn(node->right)) {
+        return recurse.child(node->left);
+      }
+      if (!dependsOn(node->left)) {
+        auto rightDiff = recurse.child(node->right);
+        return std::make_shared<ExprNode<T>>(ExprType::Sub, makeConstant((T)0),
+                                             rightDiff);
+      }
+      auto diffs = recurse.children(node->left, node->right);
+      return std::make_shared<ExprNode<T>>(ExprType::Sub, diffs.first,
+                                           diffs.second);
     }
     case ExprType::Mul: {
 
-      auto leftDiff = differentiateImpl(node->left, varName);
-      auto rightDiff = differentiateImpl(node->right, varName);
+      if (!dependsOn(node->left)) {
+        auto rightDiff = recurse.child(node->right);
+        return std::make_shared<ExprNode<T>>(ExprType::Mul, node->left,
+                                             rightDiff);
+      }
+      if (!dependsOn(node->right)) {
+        auto leftDiff = recurse.child(node->left);
+        return std::make_shared<ExprNode<T>>(ExprType::Mul, leftDiff,
+                                             node->right);
+      }
+
+      auto diffs = recurse.children(node->left, node->right);
 
       auto part1 =
-          std::make_shared<ExprNode<T>>(ExprType::Mul, leftDiff, node->right);
+          std::make_shared<ExprNode<T>>(ExprType::Mul, diffs.first,
+                                        node->right);
       auto part2 =
-          std::make_shared<ExprNode<T>>(ExprType::Mul, node->left, rightDiff);
+          std::make_shared<ExprNode<T>>(ExprType::Mul, node->left,
+                                        diffs.second);
       return std::make_shared<ExprNode<T>>(ExprType::Add, part1, part2);
     }
     case ExprType::Div: {
 
-      auto leftDiff = differentiateImpl(node->left, varName);
-      auto rightDiff = differentiateImpl(node->right, varName);
+      if (!dependsOn(node->right)) {
+        auto leftDiff = recurse.child(node->left);
+        return std::make_shared<ExprNode<T>>(ExprType::Div, leftDiff,
+                                             node->right);
+      }
 
-      auto numeratorPart1 =
-          std::make_shared<ExprNode<T>>(ExprType::Mul, leftDiff, node->right);
-      auto numeratorPart2 =
-          std::make_shared<ExprNode<T>>(ExprType::Mul, node->left, rightDiff);
-      auto numerator = std::make_shared<ExprNode<T>>(
-          ExprType::Sub, numeratorPart1, numeratorPart2);
+      std::shared_ptr<ExprNode<T>> numerator;
+      if (!dependsOn(node->left)) {
+        auto rightDiff = recurse.child(node->right);
+        auto numeratorPart2 =
+            std::make_shared<ExprNode<T>>(ExprType::Mul, node->left, rightDiff);
+        numerator = std::make_shared<ExprNode<T>>(
+            ExprType::Sub, makeConstant((T)0), numeratorPart2);
+      } else {
+        auto diffs = recurse.children(node->left, node->right);
+        auto numeratorPart1 = std::make_shared<ExprNode<T>>(
+            ExprType::Mul, diffs.first, node->right);
+        auto numeratorPart2 = std::make_shared<ExprNode<T>>(
+            ExprType::Mul, node->left, diffs.second);
+        numerator = std::make_shared<ExprNode<T>>(
+            ExprType::Sub, numeratorPart1, numeratorPart2);
+      }
 
-      auto two = std::make_shared<ExprNode<T>>(ExprType::Constant, (T)2);
+      auto two = makeConstant((T)2);
       auto denom =
           std::make_shared<ExprNode<T>>(ExprType::Pow, node->right, two);
 
@@ -534,10 +1405,9 @@ private:
 
         T c = node->right->value;
 
-        auto cNode = std::make_shared<ExprNode<T>>(ExprType::Constant, c);
+        auto cNode = makeConstant(c);
 
-        auto cMinusOneNode =
-            std::make_shared<ExprNode<T>>(ExprType::Constant, c - (T)1);
+        auto cMinusOneNode = makeConstant(c - (T)1);
 
         auto newPow = std::make_shared<ExprNode<T>>(ExprType::Pow, node->left,
                                                     cMinusOneNode);
@@ -545,12 +1415,36 @@ private:
         auto front =
             std::make_shared<ExprNode<T>>(ExprType::Mul, cNode, newPow);
 
-        auto baseDiff = differentiateImpl(node->left, varName);
+        auto baseDiff = recurse.child(node->left);
+        return std::make_shared<ExprNode<T>>(ExprType::Mul, front, baseDiff);
+      } else if (!dependsOn(node->right)) {
+
+        // v * u^(v-1) * du for an exponent that is constant in varName.
+        auto vMinusOne = std::make_shared<ExprNode<T>>(
+            ExprType::Sub, node->right, makeConstant((T)1));
+        auto newPow = std::make_shared<ExprNode<T>>(ExprType::Pow, node->left,
+                                                    vMinusOne);
+        auto front =
+            std::make_shared<ExprNode<T>>(ExprType::Mul, node->right, newPow);
+
+        auto baseDiff = recurse.child(node->left);
         return std::make_shared<ExprNode<T>>(ExprType::Mul, front, baseDiff);
+      } else if (!dependsOn(node->left)) {
+
+        // u^v * ln(u) * dv for a base that is constant in varName.
+        auto uPowv = std::make_shared<ExprNode<T>>(ExprType::Pow, node->left,
+                                                   node->right);
+        auto lnU =
+            std::make_shared<ExprNode<T>>(ExprType::Ln, node->left, nullptr);
+        auto front = std::make_shared<ExprNode<T>>(ExprType::Mul, uPowv, lnU);
+
+        auto vDiff = recurse.child(node->right);
+        return std::make_shared<ExprNode<T>>(ExprType::Mul, front, vDiff);
       } else {
 
-        auto uDiff = differentiateImpl(node->left, varName);
-        auto vDiff = differentiateImpl(node->right, varName);
+        auto diffs = recurse.children(node->left, node->right);
+        auto uDiff = diffs.first;
+        auto vDiff = diffs.second;
 
         auto uPowv = std::make_shared<ExprNode<T>>(ExprType::Pow, node->left,
                                                    node->right);
@@ -571,29 +1465,29 @@ private:
     }
     case ExprType::Sin: {
 
-      auto uDiff = differentiateImpl(node->left, varName);
+      auto uDiff = recurse.child(node->left);
       auto cosU =
           std::make_shared<ExprNode<T>>(ExprType::Cos, node->left, nullptr);
       return std::make_shared<ExprNode<T>>(ExprType::Mul, cosU, uDiff);
     }
     case ExprType::Cos: {
 
-      auto uDiff = differentiateImpl(node->left, varName);
+      auto uDiff = recurse.child(node->left);
       auto sinU =
           std::make_shared<ExprNode<T>>(ExprType::Sin, node->left, nullptr);
-      auto negOne = std::make_shared<ExprNode<T>>(ExprType::Constant, (T)-1);
+      auto negOne = makeConstant((T)-1);
       auto minusSinU =
           std::make_shared<ExprNode<T>>(ExprType::Mul, negOne, sinU);
       return std::make_shared<ExprNode<T>>(ExprType::Mul, minusSinU, uDiff);
     }
     case ExprType::Ln: {
 
-      auto uDiff = differentiateImpl(node->left, varName);
+      auto uDiff = recurse.child(node->left);
       return std::make_shared<ExprNode<T>>(ExprType::Div, uDiff, node->left);
     }
     case ExprType::Exp: {
 
-      auto uDiff = differentiateImpl(node->left, varName);
+      auto uDiff = recurse.child(node->left);
       auto expU =
           std::make_shared<ExprNode<T>>(ExprType::Exp, node->left, nullptr);
       return std::make_shared<ExprNode<T>>(ExprType::Mul, expU, uDiff);
@@ -602,6 +1496,1767 @@ private:
 
     return nullptr;
   }
+
+  // Results for nodes above the grain size, shared by all workers so that a
+  // large subtree referenced from several places is processed once.
+  struct ConcurrentMemo {
+    std::mutex mutex;
+    std::unordered_map<const ExprNode<T> *, std::shared_ptr<ExprNode<T>>> map;
+
+    std::shared_ptr<ExprNode<T>> find(const ExprNode<T> *key) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = map.find(key);
+      return it == map.end() ? nullptr : it->second;
+    }
+
+    // Keeps the first result if two workers raced on the same node.
+    std::shared_ptr<ExprNode<T>>
+    insert(const ExprNode<T> *key, const std::shared_ptr<ExprNode<T>> &value) {
+      std::lock_guard<std::mutex> lock(mutex);
+      return map.emplace(key, value).first->second;
+    }
+  };
+
+  // Result of a subtree in the fork-join traversal. Exceptions are kept
+  // instead of thrown so that the combine step can rethrow whichever one
+  // the sequential traversal would have reached first.
+  template <typename R> struct Outcome {
+    R value{};
+    std::exception_ptr error;
+  };
+
+  template <typename R> static R valueOf(const Outcome<R> &outcome) {
+    if (outcome.error) {
+      std::rethrow_exception(outcome.error);
+    }
+    return outcome.value;
+  }
+
+  // Recursion policy for the combine step, where the operands of the node
+  // have already been processed: child() just hands back their results.
+  template <typename R> struct KnownOperands {
+    const ExprNode<T> *first;
+    const Outcome<R> *firstOutcome;
+    const ExprNode<T> *second;
+    const Outcome<R> *secondOutcome;
+
+    // An absent operand reads as an empty result.
+    R child(const std::shared_ptr<ExprNode<T>> &node) const {
+      if (!node)
+        return R{};
+      return valueOf(node.get() == first ? *firstOutcome : *secondOutcome);
+    }
+
+    std::pair<R, R> children(const std::shared_ptr<ExprNode<T>> &a,
+                             const std::shared_ptr<ExprNode<T>> &b) const {
+      R x = child(a);
+      return {x, child(b)};
+    }
+
+    template <typename Check>
+    std::pair<R, R> children(const std::shared_ptr<ExprNode<T>> &a,
+                             const std::shared_ptr<ExprNode<T>> &b,
+                             Check check) const {
+      R x = child(a);
+      check(x);
+      return {x, child(b)};
+    }
+  };
+
+  // Fork-join traversal behind the pool overloads. From a node with at
+  // least grain() nodes it walks down the larger operand as long as that
+  // operand is itself above the grain, and collects the operands hanging
+  // off this path. Those are processed in parallel, in batches of roughly
+  // grain() nodes, and the path is then combined from the bottom up, so a
+  // left-folded sum of small terms is split as evenly as a balanced one.
+  // The policy supplies
+  //   sequential(node)      the result for a subtree below the grain,
+  //   known(node, result)   whether the result is available without
+  //                         visiting the operands,
+  //   combine(node, ops)    the result for node from its operands' results,
+  //   remember(node, r)     records r for node and returns the result to use.
+  template <typename R, typename Policy>
+  static void traverse(const std::shared_ptr<ExprNode<T>> &node,
+                       const Policy &policy, ForkJoinPool &pool,
+                       Outcome<R> &outcome) {
+    try {
+      if (!node || node->size < pool.grain()) {
+        outcome.value = policy.sequential(node);
+        return;
+      }
+      if (policy.known(node, outcome.value)) {
+        return;
+      }
+    } catch (...) {
+      outcome.error = std::current_exception();
+      return;
+    }
+
+    // The larger operand of spine[i] is spine[i + 1], or tasks.back() for
+    // the last entry; its other operand is tasks[side[i]], or absent (the
+    // missing operand of a unary node) when side[i] is noTask. prefix[i] is
+    // the size of the tasks before tasks[i], with each task capped at the
+    // grain so the sums cannot overflow; they are only compared against the
+    // grain.
+    constexpr std::size_t noTask = std::numeric_limits<std::size_t>::max();
+    std::vector<const std::shared_ptr<ExprNode<T>> *> spine{&node};
+    std::vector<std::size_t> side;
+    std::vector<const std::shared_ptr<ExprNode<T>> *> tasks;
+    std::vector<std::uint64_t> prefix{0};
+    auto addTask = [&](const std::shared_ptr<ExprNode<T>> &task) {
+      if (!task)
+        return noTask;
+      tasks.push_back(&task);
+      prefix.push_back(prefix.back() +
+                       std::min<std::uint64_t>(task->size, pool.grain()));
+      return tasks.size() - 1;
+    };
+    for (;;) {
+      const ExprNode<T> &current = **spine.back();
+      bool leftLarger =
+          !current.right ||
+          (current.left && current.left->size >= current.right->size);
+      const std::shared_ptr<ExprNode<T>> &larger =
+          leftLarger ? current.left : current.right;
+      side.push_back(addTask(leftLarger ? current.right : current.left));
+      R ignored{};
+      if (larger->size < pool.grain() || policy.known(larger, ignored)) {
+        addTask(larger);
+        break;
+      }
+      spine.push_back(&larger);
+    }
+    std::vector<Outcome<R>> results(tasks.size());
+    auto runTasks = [&](auto &self, std::size_t lo, std::size_t hi) -> void {
+      if (hi - lo > 1 && prefix[hi] - prefix[lo] >= 2 * pool.grain()) {
+        std::uint64_t half = prefix[lo] + (prefix[hi] - prefix[lo]) / 2;
+        std::size_t mid = std::upper_bound(prefix.begin() + lo + 1,
+                                           prefix.begin() + hi, half) -
+                          prefix.begin() - 1;
+        mid = std::min(std::max(mid, lo + 1), hi - 1);
+        pool.forkJoin([&] { self(self, lo, mid); },
+                      [&] { self(self, mid, hi); });
+        return;
+      }
+      for (std::size_t i = lo; i < hi; ++i) {
+        traverse(*tasks[i], policy, pool, results[i]);
+      }
+    };
+    runTasks(runTasks, 0, tasks.size());
+
+    // path[i] holds the result for spine[i], except that the root's goes
+    // straight into outcome.
+    std::vector<Outcome<R>> path(spine.size());
+    for (std::size_t i = spine.size(); i-- > 0;) {
+      const std::shared_ptr<ExprNode<T>> &current = *spine[i];
+      const std::shared_ptr<ExprNode<T>> &larger =
+          i + 1 < spine.size() ? *spine[i + 1] : *tasks.back();
+      const Outcome<R> &largerOutcome =
+          i + 1 < spine.size() ? path[i + 1] : results.back();
+      Outcome<R> &result = i == 0 ? outcome : path[i];
+      KnownOperands<R> operands{larger.get(), &largerOutcome, nullptr, nullptr};
+      if (side[i] != noTask) {
+        operands.second = tasks[side[i]]->get();
+        operands.secondOutcome = &results[side[i]];
+      }
+      try {
+        result.value =
+            policy.remember(current, policy.combine(current, operands));
+      } catch (...) {
+        result.error = std::current_exception();
+      }
+    }
+  }
+
+  // Small subtrees use the sequential code with a memo private to the
+  // worker that runs them; shared nodes above the grain go through the
+  // memo common to all workers.
+  struct ParallelDiff {
+    const std::string &varName;
+    std::uint64_t varBit;
+    ForkJoinPool &pool;
+    std::vector<DiffMemo> &workerMemos;
+    ConcurrentMemo &shared;
+
+    std::shared_ptr<ExprNode<T>>
+    sequential(const std::shared_ptr<ExprNode<T>> &node) const {
+      return differentiateImpl(node, varName, varBit,
+                               workerMemos[pool.workerIndex()]);
+    }
+
+    bool known(const std::shared_ptr<ExprNode<T>> &node,
+               std::shared_ptr<ExprNode<T>> &result) const {
+      if (!node->mayDependOn(varBit)) {
+        result = makeConstant((T)0);
+        return true;
+      }
+      if (!ExprNode<T>::isShared(node)) {
+        return false;
+      }
+      result = shared.find(node.get());
+      return result != nullptr;
+    }
+
+    std::shared_ptr<ExprNode<T>>
+    combine(const std::shared_ptr<ExprNode<T>> &node,
+            const KnownOperands<std::shared_ptr<ExprNode<T>>> &operands) const {
+      return differentiateNode(node, varName, varBit, operands);
+    }
+
+    std::shared_ptr<ExprNode<T>>
+    remember(const std::shared_ptr<ExprNode<T>> &node,
+             const std::shared_ptr<ExprNode<T>> &result) const {
+      return ExprNode<T>::isShared(node) ? shared.insert(node.get(), result)
+                                         : result;
+    }
+  };
+
+  struct ParallelSubstitute {
+    std::uint64_t mask;
+    ForkJoinPool &pool;
+    std::vector<SubstituteContext> &workerContexts;
+    ConcurrentMemo &shared;
+
+    std::shared_ptr<ExprNode<T>>
+    sequential(const std::shared_ptr<ExprNode<T>> &node) const {
+      return substituteImpl(node, workerContexts[pool.workerIndex()]);
+    }
+
+    bool known(const std::shared_ptr<ExprNode<T>> &node,
+               std::shared_ptr<ExprNode<T>> &result) const {
+      if (node->varMask != 0 && !node->mayDependOn(mask)) {
+        result = node;
+        return true;
+      }
+      if (!ExprNode<T>::isShared(node)) {
+        return false;
+      }
+      result = shared.find(node.get());
+      return result != nullptr;
+    }
+
+    std::shared_ptr<ExprNode<T>>
+    combine(const std::shared_ptr<ExprNode<T>> &node,
+            const KnownOperands<std::shared_ptr<ExprNode<T>>> &operands) const {
+      return rebuild(node, operands.child(node->left),
+                     operands.child(node->right));
+    }
+
+    std::shared_ptr<ExprNode<T>>
+    remember(const std::shared_ptr<ExprNode<T>> &node,
+             const std::shared_ptr<ExprNode<T>> &result) const {
+      return ExprNode<T>::isShared(node) ? shared.insert(node.get(), result)
+                                         : result;
+    }
+  };
+
+  struct ParallelEval {
+    const std::map<std::string, T> &varValues;
+
+    T sequential(const std::shared_ptr<ExprNode<T>> &node) const {
+      return evaluateImpl(node, varValues);
+    }
+
+    bool known(const std::shared_ptr<ExprNode<T>> &, T &) const {
+      return false;
+    }
+
+    T combine(const std::shared_ptr<ExprNode<T>> &node,
+              const KnownOperands<T> &operands) const {
+      return evaluateNode(node, varValues, operands);
+    }
+
+    T remember(const std::shared_ptr<ExprNode<T>> &, const T &result) const {
+      return result;
+    }
+  };
+};
+
+// Sparse multivariate polynomial: a map from exponent vectors (one entry per
+// variable in variables(), sorted by name) to non-zero coefficients, times
+// an optional product of powers of multi-term polynomials. Evaluation uses a
+// recursive Horner scheme over the variables, so no term calls std::pow, and
+// differentiation is a shift of the coefficient map.
+//
+// Expanding (x - 1)^20 into monomials cancels catastrophically near x = 1
+// and the binomial coefficients of (x + 1)^1100 overflow, so a sum raised
+// to a power above maxExpandedPower is kept as a factor and raised by
+// repeated squaring at evaluation time instead. Adding such a product to
+// something that does not share the factor expands it again, which is
+// only done up to maxCombinedPower: (x + 1)^3 + 1 is expanded, while
+// (x - 1)^20 + 1 is rejected.
+template <typename T> class Polynomial {
+public:
+  using Exponents = std::vector<unsigned>;
+  using Terms = std::map<Exponents, T>;
+
+  // base^power, where base has no factors of its own and at least two terms.
+  struct Factor {
+    std::shared_ptr<const Polynomial> base;
+    unsigned power;
+
+    bool operator==(const Factor &other) const {
+      return power == other.power && base->vars == other.base->vars &&
+             base->terms == other.base->terms;
+    }
+  };
+
+  static constexpr std::size_t defaultMaxTerms = 1 << 16;
+  static constexpr unsigned maxDegree = 1u << 20;
+  static constexpr unsigned maxExpandedPower = 2;
+  static constexpr unsigned maxCombinedPower = 8;
+
+  Polynomial() = default;
+
+  explicit Polynomial(const T &c) {
+    if (c != (T)0) {
+      terms[Exponents()] = c;
+    }
+  }
+
+  static Polynomial variable(const std::string &name) {
+    Polynomial p;
+    p.vars.push_back(name);
+    p.terms[Exponents{1}] = (T)1;
+    return p;
+  }
+
+  // Returns the polynomial form of expr, or nothing if expr uses sin, cos,
+  // ln, exp, a non-integer or negative exponent, a non-constant divisor, a
+  // sum that would expand a power above maxCombinedPower, would expand to
+  // more than maxTerms terms, or would need a coefficient that is not finite.
+  static std::optional<Polynomial>
+  fromExpression(const Expression<T> &expr,
+                 std::size_t maxTerms = defaultMaxTerms) {
+    return fromNode(expr.root, maxTerms);
+  }
+
+  const std::vector<std::string> &variables() const { return vars; }
+
+  // The expanded part; the polynomial is coefficients() times factors().
+  const Terms &coefficients() const { return terms; }
+
+  const std::vector<Factor> &factors() const { return powers; }
+
+  std::size_t termCount() const { return terms.size(); }
+
+  unsigned degree(const std::string &var) const {
+    auto it = std::lower_bound(vars.begin(), vars.end(), var);
+    if (it == vars.end() || *it != var)
+      return 0;
+    std::size_t k = it - vars.begin();
+    unsigned d = 0;
+    for (const auto &term : terms) {
+      d = std::max(d, term.first[k]);
+    }
+    for (const auto &factor : powers) {
+      d += factor.power * factor.base->degree(var);
+    }
+    return d;
+  }
+
+  // Product rule over the factors that depend on var:
+  //   (P * Q^n)' = (P' * Q + n * P * Q') * Q^(n-1)
+  Polynomial differentiate(const std::string &var) const {
+    Polynomial cofactorDiff = cofactor().differentiateTerms(var);
+    std::vector<std::size_t> dependent;
+    for (std::size_t i = 0; i < powers.size(); ++i) {
+      if (powers[i].base->degree(var) > 0)
+        dependent.push_back(i);
+    }
+
+    Polynomial sum = cofactorDiff;
+    for (std::size_t i : dependent) {
+      sum = sum * *powers[i].base;
+    }
+    for (std::size_t i : dependent) {
+      Polynomial term = cofactor() * powers[i].base->differentiateTerms(var) *
+                        Polynomial((T)powers[i].power);
+      for (std::size_t j : dependent) {
+        if (j != i)
+          term = term * *powers[j].base;
+      }
+      sum = sum + term;
+    }
+
+    Polynomial result = sum.over(mergedVariables(sum, *this));
+    for (std::size_t i = 0; i < powers.size(); ++i) {
+      Factor factor = powers[i];
+      if (std::find(dependent.begin(), dependent.end(), i) != dependent.end())
+        --factor.power;
+      if (factor.power > 0)
+        result.powers.push_back(factor);
+    }
+    result.dropZeros();
+    return result;
+  }
+
+  T evaluate(const std::map<std::string, T> &varValues = {}) const {
+    std::vector<T> point(vars.size());
+    for (std::size_t k = 0; k < vars.size(); ++k) {
+      point[k] = lookup(varValues, vars[k]);
+    }
+    if (terms.empty())
+      return (T)0;
+    T value = horner(terms.begin(), terms.end(), 0, point.data());
+    for (const auto &factor : powers) {
+      value *= ipow(factor.base->evaluate(varValues), factor.power);
+    }
+    return value;
+  }
+
+  // Evaluates the polynomial at count points. columns[k] holds the count
+  // values of variables()[k]. Points are processed in blocks so the Horner
+  // accumulators stay in cache and the inner loops are contiguous and
+  // branch-free, which lets the compiler vectorise them.
+  void evaluateBatch(const std::vector<const T *> &columns, std::size_t count,
+                     T *out) const {
+    if (columns.size() != vars.size()) {
+      throw std::invalid_argument(
+          "Polynomial::evaluateBatch expects one column per variable");
+    }
+    if (terms.empty()) {
+      std::fill(out, out + count, (T)0);
+      return;
+    }
+    std::vector<std::vector<T>> scratch(vars.size(),
+                                        std::vector<T>(batchBlock));
+    std::vector<const T *> block(vars.size());
+
+    // Each factor base reads the columns of its own variables.
+    std::vector<std::vector<std::size_t>> positions(powers.size());
+    std::vector<std::vector<std::vector<T>>> factorScratch(powers.size());
+    for (std::size_t f = 0; f < powers.size(); ++f) {
+      for (const auto &var : powers[f].base->vars) {
+        positions[f].push_back(
+            std::lower_bound(vars.begin(), vars.end(), var) - vars.begin());
+      }
+      factorScratch[f].assign(positions[f].size(), std::vector<T>(batchBlock));
+    }
+    std::vector<T> factorValues(powers.empty() ? 0 : batchBlock);
+    std::vector<const T *> factorBlock;
+
+    for (std::size_t start = 0; start < count; start += batchBlock) {
+      std::size_t n = std::min(batchBlock, count - start);
+      for (std::size_t k = 0; k < vars.size(); ++k) {
+        block[k] = columns[k] + start;
+      }
+      hornerBatch(terms.begin(), terms.end(), 0, block.data(), n, out + start,
+                  scratch);
+      for (std::size_t f = 0; f < powers.size(); ++f) {
+        const Polynomial &base = *powers[f].base;
+        factorBlock.clear();
+        for (std::size_t k : positions[f]) {
+          factorBlock.push_back(block[k]);
+        }
+        base.hornerBatch(base.terms.begin(), base.terms.end(), 0,
+                         factorBlock.data(), n, factorValues.data(),
+                         factorScratch[f]);
+        unsigned power = powers[f].power;
+        for (std::size_t i = 0; i < n; ++i)
+          out[start + i] *= ipow(factorValues[i], power);
+      }
+    }
+  }
+
+  void evaluateBatch(const std::map<std::string, std::vector<T>> &varColumns,
+                     std::vector<T> &out) const {
+    std::size_t count = batchLength(vars, varColumns);
+    std::vector<const T *> columns;
+    for (const auto &var : vars) {
+      auto it = varColumns.find(var);
+      if (it == varColumns.end()) {
+        throw std::runtime_error("Missing value for variable: " + var);
+      }
+      if (it->second.size() != count) {
+        throw std::invalid_argument("Batch columns differ in length");
+      }
+      columns.push_back(it->second.data());
+    }
+    out.resize(count);
+    evaluateBatch(columns, count, out.data());
+  }
+
+  Expression<T> toExpression() const {
+    Expression<T> result((T)0);
+    bool first = true;
+    for (auto it = terms.rbegin(); it != terms.rend(); ++it) {
+      Expression<T> term(it->second);
+      for (std::size_t k = 0; k < vars.size(); ++k) {
+        unsigned e = it->first[k];
+        if (e == 0)
+          continue;
+        Expression<T> factor(vars[k]);
+        if (e > 1)
+          factor = factor ^ Expression<T>((T)e);
+        term = term * factor;
+      }
+      result = first ? term : result + term;
+      first = false;
+    }
+    if (powers.empty())
+      return result;
+    if (cofactor().isConstant() && constantValue() == (T)1) {
+      first = true;
+    }
+    for (const auto &factor : powers) {
+      Expression<T> power =
+          factor.base->toExpression() ^ Expression<T>((T)factor.power);
+      result = first ? power : result * power;
+      first = false;
+    }
+    return result;
+  }
+
+  // Factor powers shared by both operands are kept; the rest is expanded.
+  friend Polynomial operator+(const Polynomial &lhs, const Polynomial &rhs) {
+    return combine(lhs, rhs, (T)1);
+  }
+
+  friend Polynomial operator-(const Polynomial &lhs, const Polynomial &rhs) {
+    return combine(lhs, rhs, (T)-1);
+  }
+
+  friend Polynomial operator*(const Polynomial &lhs, const Polynomial &rhs) {
+    std::vector<std::string> all = mergedVariables(lhs, rhs);
+    Polynomial a = lhs.over(all);
+    Polynomial b = rhs.over(all);
+    Polynomial result;
+    result.vars = all;
+    for (const auto &ta : a.terms) {
+      for (const auto &tb : b.terms) {
+        Exponents e(all.size());
+        for (std::size_t k = 0; k < all.size(); ++k) {
+          e[k] = ta.first[k] + tb.first[k];
+          if (e[k] > maxDegree) {
+            throw std::overflow_error("Polynomial degree limit exceeded");
+          }
+        }
+        result.terms[e] += ta.second * tb.second;
+      }
+    }
+    result.powers = a.powers;
+    for (const auto &factor : b.powers) {
+      result.addFactor(factor);
+    }
+    result.dropZeros();
+    return result;
+  }
+
+private:
+  static constexpr std::size_t batchBlock = 256;
+
+  std::vector<std::string> vars;
+  Terms terms;
+  // Sorted by base (see baseLess), with at most one entry per base.
+  std::vector<Factor> powers;
+
+  static T lookup(const std::map<std::string, T> &varValues,
+                  const std::string &var) {
+    auto it = varValues.find(var);
+    if (it == varValues.end()) {
+      throw std::runtime_error("Missing value for variable: " + var);
+    }
+    return it->second;
+  }
+
+  static T ipow(T x, unsigned n) {
+    T result = (T)1;
+    while (n) {
+      if (n & 1u)
+        result *= x;
+      n >>= 1;
+      if (n)
+        x *= x;
+    }
+    return result;
+  }
+
+  static std::vector<std::string> mergedVariables(const Polynomial &a,
+                                                  const Polynomial &b) {
+    std::vector<std::string> all;
+    std::set_union(a.vars.begin(), a.vars.end(), b.vars.begin(), b.vars.end(),
+                   std::back_inserter(all));
+    return all;
+  }
+
+  // Re-expresses the polynomial over a superset of its variables.
+  Polynomial over(const std::vector<std::string> &all) const {
+    if (all == vars)
+      return *this;
+    std::vector<std::size_t> position(vars.size());
+    for (std::size_t k = 0; k < vars.size(); ++k) {
+      position[k] = std::lower_bound(all.begin(), all.end(), vars[k]) -
+                    all.begin();
+    }
+    Polynomial result;
+    result.vars = all;
+    for (const auto &term : terms) {
+      Exponents e(all.size(), 0);
+      for (std::size_t k = 0; k < vars.size(); ++k) {
+        e[position[k]] = term.first[k];
+      }
+      result.terms.emplace(std::move(e), term.second);
+    }
+    result.powers = powers;
+    return result;
+  }
+
+  // Drops the variables that no term uses, so that equal bases compare
+  // equal whatever polynomial they were taken from.
+  Polynomial compact() const {
+    std::vector<std::string> used;
+    std::vector<std::size_t> keep;
+    for (std::size_t k = 0; k < vars.size(); ++k) {
+      bool appears = std::any_of(terms.begin(), terms.end(),
+                                 [&](const auto &t) { return t.first[k] != 0; });
+      if (appears) {
+        used.push_back(vars[k]);
+        keep.push_back(k);
+      }
+    }
+    Polynomial result;
+    result.vars = used;
+    for (const auto &term : terms) {
+      Exponents e;
+      for (std::size_t k : keep) {
+        e.push_back(term.first[k]);
+      }
+      result.terms.emplace(std::move(e), term.second);
+    }
+    return result;
+  }
+
+  Polynomial cofactor() const {
+    Polynomial result;
+    result.vars = vars;
+    result.terms = terms;
+    return result;
+  }
+
+  // Multiplies out every factor.
+  Polynomial expanded() const {
+    Polynomial result = cofactor();
+    for (const auto &factor : powers) {
+      Polynomial square = *factor.base;
+      for (unsigned n = factor.power; n; n >>= 1) {
+        if (n & 1u)
+          result = result * square;
+        if (n > 1)
+          square = square * square;
+      }
+    }
+    return result;
+  }
+
+  static bool baseLess(const Factor &a, const Factor &b) {
+    if (a.base->vars != b.base->vars)
+      return a.base->vars < b.base->vars;
+    return a.base->terms < b.base->terms;
+  }
+
+  void addFactor(const Factor &factor) {
+    auto it = std::lower_bound(powers.begin(), powers.end(), factor, baseLess);
+    if (it != powers.end() && !baseLess(factor, *it)) {
+      if ((std::uint64_t)it->power + factor.power > maxDegree) {
+        throw std::overflow_error("Polynomial degree limit exceeded");
+      }
+      it->power += factor.power;
+    } else {
+      powers.insert(it, factor);
+    }
+  }
+
+  // Splits the factors of lhs and rhs into the powers they share (the
+  // smaller power of each common base) and what is left on each side.
+  static std::vector<Factor> sharedFactors(const Polynomial &lhs,
+                                           const Polynomial &rhs,
+                                           Polynomial &lhsRest,
+                                           Polynomial &rhsRest) {
+    std::vector<Factor> shared;
+    lhsRest = lhs.cofactor();
+    rhsRest = rhs.cofactor();
+    auto a = lhs.powers.begin(), b = rhs.powers.begin();
+    while (a != lhs.powers.end() || b != rhs.powers.end()) {
+      if (b == rhs.powers.end() || (a != lhs.powers.end() && baseLess(*a, *b))) {
+        lhsRest.powers.push_back(*a++);
+      } else if (a == lhs.powers.end() || baseLess(*b, *a)) {
+        rhsRest.powers.push_back(*b++);
+      } else {
+        unsigned common = std::min(a->power, b->power);
+        shared.push_back(Factor{a->base, common});
+        if (a->power > common)
+          lhsRest.powers.push_back(Factor{a->base, a->power - common});
+        if (b->power > common)
+          rhsRest.powers.push_back(Factor{b->base, b->power - common});
+        ++a;
+        ++b;
+      }
+    }
+    return shared;
+  }
+
+  // The shared factor powers are kept; the rest is expanded.
+  static Polynomial combine(const Polynomial &lhs, const Polynomial &rhs,
+                            const T &sign) {
+    if (rhs.terms.empty())
+      return lhs;
+    if (lhs.terms.empty())
+      return rhs * Polynomial(sign);
+    Polynomial lhsRest, rhsRest;
+    std::vector<Factor> shared = sharedFactors(lhs, rhs, lhsRest, rhsRest);
+    lhsRest = lhsRest.expanded();
+    rhsRest = rhsRest.expanded();
+    std::vector<std::string> all = mergedVariables(lhs, rhs);
+    Polynomial result = lhsRest.over(all);
+    for (const auto &term : rhsRest.over(all).terms) {
+      result.terms[term.first] += sign * term.second;
+    }
+    result.powers = shared;
+    result.dropZeros();
+    return result;
+  }
+
+  // True when combining lhs and rhs expands no factor power above
+  // maxCombinedPower.
+  static bool combinesExactly(const Polynomial &lhs, const Polynomial &rhs) {
+    if (lhs.terms.empty() || rhs.terms.empty())
+      return true;
+    Polynomial lhsRest, rhsRest;
+    sharedFactors(lhs, rhs, lhsRest, rhsRest);
+    auto small = [](const Factor &f) { return f.power <= maxCombinedPower; };
+    return std::all_of(lhsRest.powers.begin(), lhsRest.powers.end(), small) &&
+           std::all_of(rhsRest.powers.begin(), rhsRest.powers.end(), small);
+  }
+
+  void dropZeros() {
+    for (auto it = terms.begin(); it != terms.end();) {
+      if (it->second == (T)0)
+        it = terms.erase(it);
+      else
+        ++it;
+    }
+    if (terms.empty())
+      powers.clear();
+  }
+
+  bool isConstant() const {
+    return powers.empty() &&
+           (terms.empty() || (terms.size() == 1 &&
+                              std::all_of(terms.begin()->first.begin(),
+                                          terms.begin()->first.end(),
+                                          [](unsigned e) { return e == 0; })));
+  }
+
+  T constantValue() const {
+    return terms.empty() ? (T)0 : terms.begin()->second;
+  }
+
+  // Differentiates the expanded part only.
+  Polynomial differentiateTerms(const std::string &var) const {
+    Polynomial result;
+    auto it = std::lower_bound(vars.begin(), vars.end(), var);
+    if (it == vars.end() || *it != var)
+      return result;
+    std::size_t k = it - vars.begin();
+    result.vars = vars;
+    for (const auto &term : terms) {
+      unsigned e = term.first[k];
+      if (e == 0)
+        continue;
+      Exponents shifted = term.first;
+      shifted[k] = e - 1;
+      result.terms[shifted] = term.second * (T)e;
+    }
+    return result;
+  }
+
+  // base^n. Monomials and small powers are expanded by repeated squaring;
+  // a multi-term expanded part raised higher becomes a factor.
+  static std::optional<Polynomial> raise(const Polynomial &base, unsigned n,
+                                         std::size_t maxTerms) {
+    if (n == 0)
+      return Polynomial((T)1);
+
+    const unsigned exponent = n;
+    Polynomial result((T)1);
+    Polynomial part = base.cofactor();
+    if (part.terms.size() <= 1 || n <= maxExpandedPower) {
+      Polynomial square = part;
+      while (n) {
+        if (n & 1u) {
+          result = result * square;
+          if (result.terms.size() > maxTerms)
+            return std::nullopt;
+        }
+        n >>= 1;
+        if (n) {
+          square = square * square;
+          if (square.terms.size() > maxTerms)
+            return std::nullopt;
+        }
+      }
+    } else {
+      result.addFactor(
+          Factor{std::make_shared<const Polynomial>(part.compact()), n});
+    }
+    result = result.over(base.vars);
+    for (const auto &factor : base.powers) {
+      if ((std::uint64_t)factor.power * exponent > maxDegree) {
+        throw std::overflow_error("Polynomial degree limit exceeded");
+      }
+      result.addFactor(Factor{factor.base, factor.power * exponent});
+    }
+    return result;
+  }
+
+  static std::optional<Polynomial>
+  fromNode(const std::shared_ptr<ExprNode<T>> &node, std::size_t maxTerms) {
+    if (!node)
+      return std::nullopt;
+
+    auto checked = [&](Polynomial p) -> std::optional<Polynomial> {
+      if (p.terms.size() > maxTerms)
+        return std::nullopt;
+      for (const auto &term : p.terms) {
+        if (!std::isfinite(term.second))
+          return std::nullopt;
+      }
+      return p;
+    };
+
+    switch (node->type) {
+    case ExprType::Constant:
+      return checked(Polynomial(node->value));
+
+    case ExprType::Variable:
+      return variable(node->varName);
+
+    case ExprType::Add:
+    case ExprType::Sub:
+    case ExprType::Mul: {
+      auto l = fromNode(node->left, maxTerms);
+      if (!l)
+        return std::nullopt;
+      auto r = fromNode(node->right, maxTerms);
+      if (!r)
+        return std::nullopt;
+      if (node->type != ExprType::Mul) {
+        if (!combinesExactly(*l, *r))
+          return std::nullopt;
+        return checked(node->type == ExprType::Add ? *l + *r : *l - *r);
+      }
+      if (l->terms.size() * r->terms.size() > maxTerms * 4)
+        return std::nullopt;
+      try {
+        return checked(*l * *r);
+      } catch (const std::overflow_error &) {
+        return std::nullopt;
+      }
+    }
+
+    case ExprType::Div: {
+      // Only division by a non-zero constant keeps the result polynomial;
+      // a zero divisor is left to evaluate() to report.
+      auto r = fromNode(node->right, maxTerms);
+      if (!r || !r->isConstant() || std::fabs(r->constantValue()) < 1e-15)
+        return std::nullopt;
+      auto l = fromNode(node->left, maxTerms);
+      if (!l)
+        return std::nullopt;
+      return checked(*l * Polynomial((T)1 / r->constantValue()));
+    }
+
+    case ExprType::Pow: {
+      auto r = fromNode(node->right, maxTerms);
+      if (!r || !r->isConstant())
+        return std::nullopt;
+      T c = r->constantValue();
+      if (c < (T)0 || c > (T)maxDegree || c != std::floor(c))
+        return std::nullopt;
+      auto base = fromNode(node->left, maxTerms);
+      if (!base)
+        return std::nullopt;
+      try {
+        auto result = raise(*base, (unsigned)c, maxTerms);
+        if (!result)
+          return std::nullopt;
+        return checked(*result);
+      } catch (const std::overflow_error &) {
+        return std::nullopt;
+      }
+    }
+
+    default:
+      return std::nullopt;
+    }
+  }
+
+  // Terms in [first, last) share their exponents of variables 0..k-1 and,
+  // because the map is ordered, are grouped by ascending exponent of
+  // variable k. Walking the groups from the top degree down gives Horner's
+  // rule in variable k, with each group's coefficient a polynomial in the
+  // remaining variables.
+  using TermIt = typename Terms::const_iterator;
+
+  T horner(TermIt first, TermIt last, std::size_t k, const T *point) const {
+    if (k == vars.size())
+      return first->second;
+
+    T acc = (T)0;
+    unsigned prevDeg = 0;
+    bool started = false;
+    TermIt groupEnd = last;
+    while (groupEnd != first) {
+      unsigned deg = std::prev(groupEnd)->first[k];
+      TermIt groupBegin = std::prev(groupEnd);
+      while (groupBegin != first && std::prev(groupBegin)->first[k] == deg)
+        --groupBegin;
+      T c = horner(groupBegin, groupEnd, k + 1, point);
+      acc = started ? acc * ipow(point[k], prevDeg - deg) + c : c;
+      started = true;
+      prevDeg = deg;
+      groupEnd = groupBegin;
+    }
+    return prevDeg ? acc * ipow(point[k], prevDeg) : acc;
+  }
+
+  void hornerBatch(TermIt first, TermIt last, std::size_t k,
+                   const T *const *columns, std::size_t n, T *out,
+                   std::vector<std::vector<T>> &scratch) const {
+    if (k == vars.size()) {
+      std::fill(out, out + n, first->second);
+      return;
+    }
+
+    const T *x = columns[k];
+    T *c = scratch[k].data();
+    unsigned prevDeg = 0;
+    bool started = false;
+    TermIt groupEnd = last;
+    while (groupEnd != first) {
+      unsigned deg = std::prev(groupEnd)->first[k];
+      TermIt groupBegin = std::prev(groupEnd);
+      while (groupBegin != first && std::prev(groupBegin)->first[k] == deg)
+        --groupBegin;
+      if (!started) {
+        hornerBatch(groupBegin, groupEnd, k + 1, columns, n, out, scratch);
+      } else {
+        hornerBatch(groupBegin, groupEnd, k + 1, columns, n, c, scratch);
+        unsigned gap = prevDeg - deg;
+        if (gap == 1) {
+          for (std::size_t i = 0; i < n; ++i)
+            out[i] = out[i] * x[i] + c[i];
+        } else {
+          for (std::size_t i = 0; i < n; ++i)
+            out[i] = out[i] * ipow(x[i], gap) + c[i];
+        }
+      }
+      started = true;
+      prevDeg = deg;
+      groupEnd = groupBegin;
+    }
+    if (prevDeg == 1) {
+      for (std::size_t i = 0; i < n; ++i)
+        out[i] *= x[i];
+    } else if (prevDeg > 1) {
+      for (std::size_t i = 0; i < n; ++i)
+        out[i] *= ipow(x[i], prevDeg);
+    }
+  }
+};
+
+// Error bits recorded per point by CompiledExpression::evaluateBatchNoThrow.
+// They mirror the errors Expression::evaluate throws.
+enum class EvalError : std::uint8_t {
+  None = 0,
+  DivisionByZero = 1,
+  LnDomain = 2,
+  MissingVariable = 4
+};
+
+inline EvalError operator|(EvalError a, EvalError b) {
+  return EvalError(std::uint8_t(a) | std::uint8_t(b));
+}
+
+inline bool hasError(std::uint8_t code, EvalError err) {
+  return (code & std::uint8_t(err)) != 0;
+}
+
+// Per-point outcome of a non-throwing batch evaluation: codes[i] is the OR
+// of the EvalError bits raised at point i, and bit i of mask is set when
+// codes[i] is non-zero, so failures can be found 64 points at a time.
+struct EvalErrors {
+  std::vector<std::uint8_t> codes;
+  std::vector<std::uint64_t> mask;
+  std::size_t failedCount = 0;
+
+  bool any() const { return failedCount != 0; }
+
+  bool failed(std::size_t i) const { return (mask[i / 64] >> (i % 64)) & 1u; }
+};
+
+// Expression lowered to a flat instruction tape for repeated and batch
+// evaluation. Lowering shares repeated subtrees, folds variable-free subtrees
+// and strength-reduces the tree:
+//   u^n for integer |n| <= maxChainExponent  ->  multiply chain (1/chain if n<0)
+//   u / c for a non-zero constant c          ->  u * (1/c)
+//   exp(ln u)                                ->  u, still checked for u > 0
+//   ln(exp u)                                ->  u
+//   sin(u) and cos(u) of the same u          ->  one SinCos instruction
+// Sin, Cos, SinCos, Ln and Exp run through the simd_math batch kernels.
+// Errors match Expression::evaluate: division by zero, ln of a non-positive
+// value and missing variables throw std::runtime_error.
+template <typename T> class CompiledExpression {
+public:
+  enum class Op : std::uint8_t {
+    Const,
+    Var,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    MulConst,
+    Recip,
+    Pow,
+    Sin,
+    Cos,
+    SinCos,
+    Ln,
+    Exp,
+    CheckPositive
+  };
+
+  static constexpr int maxChainExponent = 64;
+
+  explicit CompiledExpression(const Expression<T> &expr) {
+    if (!expr.root) {
+      throw std::runtime_error("Cannot compile an empty expression");
+    }
+    Lowering lowering(*this);
+    std::uint32_t resultValue = lowering.lower(expr.root);
+    allocateRegisters(resultValue);
+  }
+
+  const std::vector<std::string> &variables() const { return vars; }
+
+  std::size_t instructionCount() const { return code.size(); }
+
+  std::size_t countOps(Op op) const {
+    return std::count_if(code.begin(), code.end(),
+                         [op](const Instr &in) { return in.op == op; });
+  }
+
+  T evaluate(const std::map<std::string, T> &varValues = {}) const {
+    std::vector<T> point(vars.size());
+    std::vector<const T *> columns(vars.size());
+    for (std::size_t k = 0; k < vars.size(); ++k) {
+      auto it = varValues.find(vars[k]);
+      if (it == varValues.end()) {
+        throw std::runtime_error("Missing value for variable: " + vars[k]);
+      }
+      point[k] = it->second;
+      columns[k] = &point[k];
+    }
+    std::vector<T> regs(registerCount);
+    execute(columns.data(), 1, regs.data(), 1);
+    return regs[result];
+  }
+
+  // Evaluates count points; columns[k] holds the values of variables()[k].
+  void evaluateBatch(const std::vector<const T *> &columns, std::size_t count,
+                     T *out) const {
+    if (columns.size() != vars.size()) {
+      throw std::invalid_argument(
+          "CompiledExpression::evaluateBatch expects one column per variable");
+    }
+    std::vector<T> regs(registerCount * batchBlock);
+    std::vector<const T *> block(vars.size());
+    for (std::size_t start = 0; start < count; start += batchBlock) {
+      std::size_t n = std::min(batchBlock, count - start);
+      for (std::size_t k = 0; k < vars.size(); ++k) {
+        block[k] = columns[k] + start;
+      }
+      execute(block.data(), n, regs.data(), batchBlock);
+      std::copy(regs.begin() + result * batchBlock,
+                regs.begin() + result * batchBlock + n, out + start);
+    }
+  }
+
+  void evaluateBatch(const std::map<std::string, std::vector<T>> &varColumns,
+                     std::vector<T> &out) const {
+    std::size_t count = batchLength(vars, varColumns);
+    std::vector<const T *> columns;
+    for (const auto &var : vars) {
+      auto it = varColumns.find(var);
+      if (it == varColumns.end()) {
+        throw std::runtime_error("Missing value for variable: " + var);
+      }
+      if (it->second.size() != count) {
+        throw std::invalid_argument("Batch columns differ in length");
+      }
+      columns.push_back(it->second.data());
+    }
+    out.resize(count);
+    evaluateBatch(columns, count, out.data());
+  }
+
+  // Evaluates count points without throwing on bad data. Division by zero
+  // and ln of a non-positive value produce the IEEE result (inf or NaN) and
+  // set the matching bit in errors.codes; a null column is a missing
+  // variable and makes every point NaN. If sentinel is given it replaces the
+  // result of every point that raised an error. The error checks are
+  // branch-free flag updates, so the inner loops stay vectorisable.
+  void evaluateBatchNoThrow(const std::vector<const T *> &columns,
+                            std::size_t count, T *out, EvalErrors &errors,
+                            std::optional<T> sentinel = std::nullopt) const {
+    if (columns.size() != vars.size()) {
+      throw std::invalid_argument(
+          "CompiledExpression::evaluateBatchNoThrow expects one column per "
+          "variable");
+    }
+    errors.codes.assign(count, 0);
+    errors.mask.assign((count + 63) / 64, 0);
+    errors.failedCount = 0;
+
+    std::uint8_t missing = 0;
+    std::vector<T> nanColumn;
+    std::vector<const T *> bound(columns);
+    for (auto &column : bound) {
+      if (column == nullptr) {
+        missing = std::uint8_t(EvalError::MissingVariable);
+        nanColumn.assign(batchBlock, std::numeric_limits<T>::quiet_NaN());
+      }
+    }
+
+    std::vector<T> regs(registerCount * batchBlock);
+    std::vector<const T *> block(vars.size());
+    for (std::size_t start = 0; start < count; start += batchBlock) {
+      std::size_t n = std::min(batchBlock, count - start);
+      for (std::size_t k = 0; k < vars.size(); ++k) {
+        block[k] = bound[k] ? bound[k] + start : nanColumn.data();
+      }
+      std::uint8_t *codes = errors.codes.data() + start;
+      std::fill(codes, codes + n, missing);
+      execute(block.data(), n, regs.data(), batchBlock, codes);
+      const T *res = regs.data() + result * batchBlock;
+      if (sentinel) {
+        for (std::size_t i = 0; i < n; ++i)
+          out[start + i] = codes[i] ? *sentinel : res[i];
+      } else {
+        std::copy(res, res + n, out + start);
+      }
+    }
+
+    for (std::size_t i = 0; i < count; ++i) {
+      std::uint64_t failed = errors.codes[i] != 0;
+      errors.mask[i / 64] |= failed << (i % 64);
+      errors.failedCount += failed;
+    }
+  }
+
+  void
+  evaluateBatchNoThrow(const std::map<std::string, std::vector<T>> &varColumns,
+                       std::vector<T> &out, EvalErrors &errors,
+                       std::optional<T> sentinel = std::nullopt) const {
+    std::size_t count = batchLength(vars, varColumns);
+    std::vector<const T *> columns;
+    for (const auto &var : vars) {
+      auto it = varColumns.find(var);
+      if (it != varColumns.end() && it->second.size() != count) {
+        throw std::invalid_argument("Batch columns differ in length");
+      }
+      columns.push_back(it == varColumns.end() ? nullptr : it->second.data());
+    }
+    out.resize(count);
+    evaluateBatchNoThrow(columns, count, out.data(), errors, sentinel);
+  }
+
+private:
+  static constexpr std::size_t batchBlock = 256;
+  static constexpr std::uint32_t none = UINT32_MAX;
+
+  // Before register allocation dst, dst2, a and b name SSA values; afterwards
+  // they name registers. Var keeps its column index in a.
+  struct Instr {
+    Op op;
+    std::uint32_t dst;
+    std::uint32_t dst2;
+    std::uint32_t a;
+    std::uint32_t b;
+    T imm;
+  };
+
+  std::vector<Instr> code;
+  std::vector<std::string> vars;
+  std::uint32_t result = 0;
+  std::uint32_t registerCount = 0;
+
+  struct Lowering {
+    CompiledExpression &out;
+    std::uint32_t valueCount = 0;
+    std::unordered_map<const ExprNode<T> *, std::uint32_t> memo;
+    std::map<T, std::uint32_t> constants;
+    std::map<std::string, std::uint32_t> variables;
+    std::unordered_map<std::uint32_t, std::size_t> sinOf;
+    std::unordered_map<std::uint32_t, std::size_t> cosOf;
+    // Folded value of each variable-free node tried so far, or nothing if
+    // evaluating it throws.
+    std::unordered_map<const ExprNode<T> *, std::optional<T>> folds;
+
+    explicit Lowering(CompiledExpression &target) : out(target) {}
+
+    std::uint32_t emit(Op op, std::uint32_t a = none, std::uint32_t b = none,
+                       const T &imm = T()) {
+      out.code.push_back(Instr{op, valueCount, none, a, b, imm});
+      return valueCount++;
+    }
+
+    std::uint32_t constant(const T &val) {
+      if (val != val)
+        return emit(Op::Const, none, none, val);
+      auto it = constants.find(val);
+      if (it != constants.end())
+        return it->second;
+      std::uint32_t v = emit(Op::Const, none, none, val);
+      constants.emplace(val, v);
+      return v;
+    }
+
+    std::uint32_t variable(const std::string &name) {
+      auto it = variables.find(name);
+      if (it != variables.end())
+        return it->second;
+      std::uint32_t column = (std::uint32_t)out.vars.size();
+      out.vars.push_back(name);
+      std::uint32_t v = emit(Op::Var, column);
+      variables.emplace(name, v);
+      return v;
+    }
+
+    // Variable-free subtrees are evaluated once here unless they would
+    // throw, in which case they are lowered so the error surfaces at run time.
+    // Each node is folded from its operands' folded values and remembered,
+    // so neither a failing nor a shared constant subtree is evaluated again
+    // by the nodes above it.
+    bool tryFold(const std::shared_ptr<ExprNode<T>> &node, T &val) {
+      if (!node || node->varMask != 0)
+        return false;
+      auto it = folds.find(node.get());
+      if (it == folds.end())
+        it = folds.emplace(node.get(), foldNode(node)).first;
+      if (!it->second)
+        return false;
+      val = *it->second;
+      return true;
+    }
+
+    std::optional<T> foldNode(const std::shared_ptr<ExprNode<T>> &node) {
+      T ignored;
+      if ((node->left && !tryFold(node->left, ignored)) ||
+          (node->right && !tryFold(node->right, ignored)))
+        return std::nullopt;
+      try {
+        return Expression<T>::evaluateNode(node, {}, FoldedOperands{folds});
+      } catch (const std::runtime_error &) {
+        return std::nullopt;
+      }
+    }
+
+    // Recursion policy for foldNode: the operands are already folded.
+    struct FoldedOperands {
+      const std::unordered_map<const ExprNode<T> *, std::optional<T>> &folds;
+
+      T child(const std::shared_ptr<ExprNode<T>> &node) const {
+        return *folds.at(node.get());
+      }
+
+      template <typename Check>
+      std::pair<T, T> children(const std::shared_ptr<ExprNode<T>> &a,
+                               const std::shared_ptr<ExprNode<T>> &b,
+                               Check check) const {
+        T x = child(a);
+        check(x);
+        return {x, child(b)};
+      }
+    };
+
+    std::uint32_t multiplyChain(std::uint32_t base, unsigned n) {
+      std::uint32_t acc = none;
+      std::uint32_t square = base;
+      while (n) {
+        if (n & 1u)
+          acc = (acc == none) ? square : emit(Op::Mul, acc, square);
+        n >>= 1;
+        if (n)
+          square = emit(Op::Mul, square, square);
+      }
+      return acc;
+    }
+
+    std::uint32_t sinCos(Op op, std::uint32_t arg) {
+      auto &same = (op == Op::Sin) ? sinOf : cosOf;
+      auto &other = (op == Op::Sin) ? cosOf : sinOf;
+      auto it = same.find(arg);
+      if (it != same.end()) {
+        const Instr &in = out.code[it->second];
+        return (op == Op::Sin || in.op == Op::Cos) ? in.dst : in.dst2;
+      }
+      auto pair = other.find(arg);
+      if (pair != other.end()) {
+        // Turn the earlier Sin or Cos into SinCos (dst = sin, dst2 = cos).
+        Instr &in = out.code[pair->second];
+        std::uint32_t fresh = valueCount++;
+        if (in.op == Op::Sin) {
+          in.dst2 = fresh;
+        } else {
+          in.dst2 = in.dst;
+          in.dst = fresh;
+        }
+        in.op = Op::SinCos;
+        same.emplace(arg, pair->second);
+        return fresh;
+      }
+      std::uint32_t v = emit(op, arg);
+      same.emplace(arg, out.code.size() - 1);
+      return v;
+    }
+
+    std::uint32_t lower(const std::shared_ptr<ExprNode<T>> &node) {
+      auto found = memo.find(node.get());
+      if (found != memo.end())
+        return found->second;
+      std::uint32_t v = lowerNode(node);
+      memo.emplace(node.get(), v);
+      return v;
+    }
+
+    std::uint32_t lowerNode(const std::shared_ptr<ExprNode<T>> &node) {
+      if (!node) {
+        throw std::runtime_error("Cannot evaluate an empty node");
+      }
+
+      T folded;
+      if (tryFold(node, folded))
+        return constant(folded);
+
+      switch (node->type) {
+      case ExprType::Constant:
+        return constant(node->value);
+
+      case ExprType::Variable:
+        return variable(node->varName);
+
+      case ExprType::Add:
+        return emit(Op::Add, lower(node->left), lower(node->right));
+
+      case ExprType::Sub:
+        return emit(Op::Sub, lower(node->left), lower(node->right));
+
+      case ExprType::Mul:
+        return emit(Op::Mul, lower(node->left), lower(node->right));
+
+      case ExprType::Div: {
+        T c;
+        if (tryFold(node->right, c) && std::fabs(c) >= 1e-15) {
+          return emit(Op::MulConst, lower(node->left), none, (T)1 / c);
+        }
+        return emit(Op::Div, lower(node->left), lower(node->right));
+      }
+
+      case ExprType::Pow: {
+        T c;
+        if (tryFold(node->right, c) && c == std::floor(c) &&
+            std::fabs(c) <= (T)maxChainExponent) {
+          int n = (int)c;
+          if (n == 0) {
+            // The base is still lowered so its errors are still raised.
+            lower(node->left);
+            return constant((T)1);
+          }
+          std::uint32_t chain =
+              multiplyChain(lower(node->left), (unsigned)std::abs(n));
+          return n > 0 ? chain : emit(Op::Recip, chain);
+        }
+        return emit(Op::Pow, lower(node->left), lower(node->right));
+      }
+
+      case ExprType::Sin:
+        return sinCos(Op::Sin, lower(node->left));
+
+      case ExprType::Cos:
+        return sinCos(Op::Cos, lower(node->left));
+
+      case ExprType::Ln:
+        if (node->left && node->left->type == ExprType::Exp)
+          return lower(node->left->left);
+        return emit(Op::Ln, lower(node->left));
+
+      case ExprType::Exp:
+        if (node->left && node->left->type == ExprType::Ln)
+          return emit(Op::CheckPositive, lower(node->left->left));
+        return emit(Op::Exp, lower(node->left));
+      }
+      throw std::runtime_error("Unknown expression type in CompiledExpression");
+    }
+  };
+
+  static bool readsA(Op op) { return op != Op::Const && op != Op::Var; }
+
+  static bool readsB(Op op) {
+    return op == Op::Add || op == Op::Sub || op == Op::Mul || op == Op::Div ||
+           op == Op::Pow;
+  }
+
+  // Maps SSA values onto a small set of reusable registers so the batch
+  // register file stays cache-resident. A register is released after the
+  // instruction holding the last use of its value.
+  void allocateRegisters(std::uint32_t resultValue) {
+    std::uint32_t values = 0;
+    for (const Instr &in : code) {
+      values = std::max(values, in.dst + 1);
+      if (in.dst2 != none)
+        values = std::max(values, in.dst2 + 1);
+    }
+    std::vector<std::size_t> lastUse(values, 0);
+    for (std::size_t i = 0; i < code.size(); ++i) {
+      if (readsA(code[i].op))
+        lastUse[code[i].a] = i;
+      if (readsB(code[i].op))
+        lastUse[code[i].b] = i;
+    }
+    lastUse[resultValue] = code.size();
+
+    std::vector<std::uint32_t> reg(values, none);
+    std::vector<std::uint32_t> freeRegs;
+    auto acquire = [&]() {
+      if (freeRegs.empty())
+        return registerCount++;
+      std::uint32_t r = freeRegs.back();
+      freeRegs.pop_back();
+      return r;
+    };
+
+    for (std::size_t i = 0; i < code.size(); ++i) {
+      Instr &in = code[i];
+      std::uint32_t a = readsA(in.op) ? in.a : none;
+      std::uint32_t b = readsB(in.op) ? in.b : none;
+      auto releaseOperands = [&]() {
+        if (a != none && lastUse[a] == i)
+          freeRegs.push_back(reg[a]);
+        if (b != none && b != a && lastUse[b] == i)
+          freeRegs.push_back(reg[b]);
+      };
+      if (a != none)
+        in.a = reg[a];
+      if (b != none)
+        in.b = reg[b];
+
+      // SinCos writes two results, so its operand must outlive both writes.
+      if (in.op != Op::SinCos)
+        releaseOperands();
+      std::uint32_t dst = in.dst;
+      in.dst = reg[dst] = acquire();
+      if (in.dst2 != none) {
+        std::uint32_t dst2 = in.dst2;
+        in.dst2 = reg[dst2] = acquire();
+        if (lastUse[dst2] <= i)
+          freeRegs.push_back(in.dst2);
+      }
+      if (in.op == Op::SinCos)
+        releaseOperands();
+      if (lastUse[dst] <= i)
+        freeRegs.push_back(in.dst);
+    }
+    result = reg[resultValue];
+  }
+
+  // Runs the tape on n points; register r occupies regs[r * stride, + n).
+  // With codes == nullptr errors throw; otherwise they are ORed into codes
+  // and evaluation continues with the IEEE result.
+  void execute(const T *const *columns, std::size_t n, T *regs,
+               std::size_t stride, std::uint8_t *codes = nullptr) const {
+    for (const Instr &in : code) {
+      T *d = regs + in.dst * stride;
+      const T *a = readsA(in.op) ? regs + in.a * stride : nullptr;
+      const T *b = readsB(in.op) ? regs + in.b * stride : nullptr;
+      switch (in.op) {
+      case Op::Const:
+        std::fill(d, d + n, in.imm);
+        break;
+      case Op::Var:
+        std::copy(columns[in.a], columns[in.a] + n, d);
+        break;
+      case Op::Add:
+        for (std::size_t i = 0; i < n; ++i)
+          d[i] = a[i] + b[i];
+        break;
+      case Op::Sub:
+        for (std::size_t i = 0; i < n; ++i)
+          d[i] = a[i] - b[i];
+        break;
+      case Op::Mul:
+        for (std::size_t i = 0; i < n; ++i)
+          d[i] = a[i] * b[i];
+        break;
+      case Op::Div: {
+        if (codes) {
+          for (std::size_t i = 0; i < n; ++i)
+            codes[i] |= std::uint8_t(std::fabs(b[i]) < 1e-15) *
+                        std::uint8_t(EvalError::DivisionByZero);
+        } else {
+          bool zero = false;
+          for (std::size_t i = 0; i < n; ++i)
+            zero |= std::fabs(b[i]) < 1e-15;
+          if (zero) {
+            throw std::runtime_error("Division by zero");
+          }
+        }
+        for (std::size_t i = 0; i < n; ++i)
+          d[i] = a[i] / b[i];
+        break;
+      }
+      case Op::MulConst:
+        for (std::size_t i = 0; i < n; ++i)
+          d[i] = a[i] * in.imm;
+        break;
+      case Op::Recip:
+        for (std::size_t i = 0; i < n; ++i)
+          d[i] = (T)1 / a[i];
+        break;
+      case Op::Pow:
+        for (std::size_t i = 0; i < n; ++i)
+          d[i] = std::pow(a[i], b[i]);
+        break;
+      case Op::Sin:
+        simd_math::sin(a, d, n);
+        break;
+      case Op::Cos:
+        simd_math::cos(a, d, n);
+        break;
+      case Op::SinCos:
+        simd_math::sincos(a, d, regs + in.dst2 * stride, n);
+        break;
+      case Op::Ln:
+      case Op::CheckPositive: {
+        if (codes) {
+          for (std::size_t i = 0; i < n; ++i)
+            codes[i] |= std::uint8_t(a[i] <= (T)0) *
+                        std::uint8_t(EvalError::LnDomain);
+        } else {
+          bool bad = false;
+          for (std::size_t i = 0; i < n; ++i)
+            bad |= a[i] <= (T)0;
+          if (bad) {
+            throw std::runtime_error("ln domain error: argument <= 0");
+          }
+        }
+        if (in.op == Op::Ln) {
+          simd_math::log(a, d, n);
+        } else {
+          // exp(ln u) is u where ln u is defined and NaN below zero.
+          for (std::size_t i = 0; i < n; ++i)
+            d[i] = a[i] < (T)0 ? std::numeric_limits<T>::quiet_NaN() : a[i];
+        }
+        break;
+      }
+      case Op::Exp:
+        simd_math::exp(a, d, n);
+        break;
+      }
+    }
+  }
+};
+
+// Thread-safe cache of parsed (and optionally differentiated) expressions keyed
+// by their trimmed source text. Entries are immutable and shared, so a
+// hit costs one shard lock and one refcount increment. Keys are spread over
+// independently locked shards, each holding its own LRU list, to keep
+// contention low when many threads look up the same few formulas.
+template <typename T> class ExpressionCache {
+public:
+  using Compiled = std::shared_ptr<const Expression<T>>;
+
+  struct Stats {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t evictions = 0;
+    std::size_t size = 0;
+  };
+
+  explicit ExpressionCache(std::size_t capacity = 1024,
+                           std::size_t shardCount = 16) {
+    if (capacity == 0 || shardCount == 0) {
+      throw std::invalid_argument(
+          "ExpressionCache needs a non-zero capacity and shard count");
+    }
+    if (shardCount > capacity) {
+      shardCount = capacity;
+    }
+    this->capacity = capacity;
+    shards.reserve(shardCount);
+    for (std::size_t i = 0; i < shardCount; ++i) {
+      shards.emplace_back(new Shard());
+    }
+  }
+
+  ExpressionCache(const ExpressionCache &) = delete;
+  ExpressionCache &operator=(const ExpressionCache &) = delete;
+
+  // Returns parse(exprStr), or its derivative by diffVar when diffVar is
+  // non-empty. Both are trimmed like parse() input. The derivative entry is
+  // built from the cached parse entry. Each call counts as exactly one hit
+  // or one miss.
+  Compiled get(const std::string &exprStr, const std::string &diffVar = "") {
+    return fetch(normalize(exprStr), normalize(diffVar), true);
+  }
+
+  Stats stats() const {
+    Stats total;
+    for (const auto &shard : shards) {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      total.hits += shard->hits;
+      total.misses += shard->misses;
+      total.evictions += shard->evictions;
+      total.size += shard->index.size();
+    }
+    return total;
+  }
+
+  void clear() {
+    for (auto &shard : shards) {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      entryCount -= shard->index.size();
+      shard->lru.clear();
+      shard->index.clear();
+    }
+  }
+
+  // Only leading and trailing whitespace is dropped, as parse() does; inner
+  // whitespace can change the meaning ("sin (x)" is a variable name).
+  static std::string normalize(const std::string &exprStr) {
+    const char *ws = " \t\n\r";
+    std::size_t start = exprStr.find_first_not_of(ws);
+    if (start == std::string::npos) {
+      return "";
+    }
+    std::size_t end = exprStr.find_last_not_of(ws);
+    return exprStr.substr(start, end - start + 1);
+  }
+
+private:
+  struct Shard {
+    using Entry = std::pair<std::string, Compiled>;
+
+    Compiled lookup(const std::string &key, bool counted) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = index.find(key);
+      if (it == index.end()) {
+        misses += counted;
+        return nullptr;
+      }
+      hits += counted;
+      lru.splice(lru.begin(), lru, it->second);
+      return it->second->second;
+    }
+
+    // Returns the cached value and whether a new entry was added.
+    std::pair<Compiled, bool> insert(const std::string &key,
+                                     const Compiled &value) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = index.find(key);
+      if (it != index.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+        return {it->second->second, false};
+      }
+      lru.emplace_front(key, value);
+      index.emplace(key, lru.begin());
+      return {value, true};
+    }
+
+    // Drops the least recently used entry unless only keep would remain.
+    bool evictOne(const std::string *keep) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (lru.empty() || (keep && lru.size() == 1 && lru.back().first == *keep))
+        return false;
+      index.erase(lru.back().first);
+      lru.pop_back();
+      ++evictions;
+      return true;
+    }
+
+    mutable std::mutex mutex;
+    std::list<Entry> lru;
+    std::unordered_map<std::string, typename std::list<Entry>::iterator> index;
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t evictions = 0;
+  };
+
+  std::size_t shardIndex(const std::string &key) const {
+    return std::hash<std::string>{}(key) % shards.size();
+  }
+
+  // The text is prefixed with its length, so no text and variable pair can
+  // produce the key of another.
+  static std::string entryKey(const std::string &text,
+                              const std::string &diffVar) {
+    return std::to_string(text.size()) + ':' + text + diffVar;
+  }
+
+  Compiled fetch(const std::string &text, const std::string &diffVar,
+                 bool counted) {
+    std::string key = entryKey(text, diffVar);
+    std::size_t home = shardIndex(key);
+
+    if (Compiled hit = shards[home]->lookup(key, counted)) {
+      return hit;
+    }
+
+    // Parsing and differentiating happen outside the shard lock; if another
+    // thread inserts the same key meanwhile, its entry wins.
+    Compiled built;
+    if (diffVar.empty()) {
+      built = std::make_shared<const Expression<T>>(Expression<T>::parse(text));
+    } else {
+      built = std::make_shared<const Expression<T>>(
+          fetch(text, "", false)->differentiate(diffVar));
+    }
+    auto inserted = shards[home]->insert(key, built);
+    if (inserted.second) {
+      ++entryCount;
+      evictOverflow(home, key);
+    }
+    return inserted.first;
+  }
+
+  // Capacity is shared by all shards: an insert that takes the total over
+  // capacity evicts the least recently used entry of its own shard, or of
+  // the next non-empty shard when its own holds only the new entry. Each
+  // eviction is claimed by decrementing entryCount first, so concurrent
+  // inserts never evict more than the overflow.
+  void evictOverflow(std::size_t home, const std::string &newKey) {
+    std::size_t count = entryCount.load();
+    while (count > capacity) {
+      if (!entryCount.compare_exchange_weak(count, count - 1)) {
+        continue;
+      }
+      bool evicted = false;
+      for (std::size_t k = 0; k < shards.size() && !evicted; ++k) {
+        std::size_t i = (home + k) % shards.size();
+        evicted = shards[i]->evictOne(k == 0 ? &newKey : nullptr);
+      }
+      if (!evicted) {
+        ++entryCount;
+        return;
+      }
+      count = entryCount.load();
+    }
+  }
+
+  std::vector<std::unique_ptr<Shard>> shards;
+  std::size_t capacity;
+  std::atomic<std::size_t> entryCount{0};
 };
 
 #endif
\ No newline at end of file
@@ -3,6 +3,10 @@
 #include <cmath>
 #include <string>
 #include <complex>
+#include <limits>
+#include <random>
+#include <thread>
+#include <vector>
 
 #include <stdexcept>
 #include "../differentiator.hpp"
@@ -159,6 +163,645 @@ void testDifferentiation() {
     checkTest(ok2, "Differentiate x*sin(x) wrt x => x*cos(x) + sin(x)");
 }
 
+void testDependencyAwareDifferentiation() {
+    using E = Expression<double>;
+
+    E sum = E::parse("3*y + sin(z)*y + x");
+    checkTest(sum.differentiate("x").toString() == "1",
+              "Differentiate 3*y + sin(z)*y + x wrt x => 1");
+
+    E prod = E::parse("(y*z) * x");
+    checkTest(prod.differentiate("x").toString() == "((y * z) * 1)",
+              "Differentiate (y*z)*x wrt x keeps the constant factor");
+
+    checkTest(E::parse("sin(y) / ln(z)").differentiate("x").toString() == "0",
+              "Differentiate variable-free subtree wrt x => 0");
+
+    E mixed = E::parse("(x^y) / (2 + z) + y^x");
+    E dMixed = mixed.differentiate("x");
+    std::map<std::string, double> at = {{"x", 1.5}, {"y", 2.5}, {"z", 0.5}};
+    double expected = 2.5 * std::pow(1.5, 1.5) / 2.5 + std::pow(2.5, 1.5) * std::log(2.5);
+    checkTest(std::fabs(dMixed.evaluate(at) - expected) < 1e-9,
+              "Differentiate (x^y)/(2+z) + y^x wrt x matches closed form");
+}
+
+void testExpressionCache() {
+    using Cache = ExpressionCache<double>;
+
+    Cache cache(64, 4);
+    auto first = cache.get("x*sin(x)");
+    auto second = cache.get("  x*sin(x)\n");
+    checkTest(first == second, "Cache shares one entry across surrounding whitespace");
+    checkTest(cache.get("sin (x)")->toString() == Expression<double>::parse("sin (x)").toString() &&
+              cache.get("1 2")->toString() == Expression<double>::parse("1 2").toString(),
+              "Cache keeps the meaning of inner whitespace");
+
+    auto derivative = cache.get("x*sin(x)", "x");
+    std::map<std::string, double> vals = {{"x", 2.0}};
+    double expected = std::sin(2.0) + 2.0 * std::cos(2.0);
+    checkTest(std::fabs(derivative->evaluate(vals) - expected) < 1e-9,
+              "Cache returns the derivative when a variable is given");
+    checkTest(cache.get("x*sin(x)", " x\t") == derivative,
+              "Cache trims the differentiation variable");
+
+    Cache::Stats before = cache.stats();
+    const std::vector<std::string> formulas = {"x+1", "x*x", "sin(x)*y", "exp(x)/y"};
+    const int threadCount = 8;
+    const int lookupsPerThread = 500;
+    std::vector<std::thread> threads;
+    bool consistent = true;
+    std::vector<char> threadOk(threadCount, 1);
+    for (int t = 0; t < threadCount; ++t) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < lookupsPerThread; ++i) {
+                const std::string& f = formulas[static_cast<std::size_t>(i) % formulas.size()];
+                auto entry = cache.get(f);
+                auto entryDiff = cache.get(f, "x");
+                if (!entry || !entryDiff || entry != cache.get(f)) {
+                    threadOk[static_cast<std::size_t>(t)] = 0;
+                }
+            }
+        });
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    for (char ok : threadOk) {
+        consistent = consistent && ok;
+    }
+    Cache::Stats stats = cache.stats();
+    checkTest(consistent && stats.size == 4 + 2 * formulas.size(),
+              "Cache stays consistent under concurrent lookups");
+    checkTest(stats.hits + stats.misses - before.hits - before.misses ==
+                  static_cast<std::uint64_t>(3 * threadCount * lookupsPerThread),
+              "Cache counts exactly one lookup per get()");
+
+    Cache tiny(2, 1);
+    auto a = tiny.get("a");
+    tiny.get("b");
+    tiny.get("a");
+    tiny.get("c");
+    Cache::Stats tinyStats = tiny.stats();
+    checkTest(tinyStats.evictions == 1 && tinyStats.size == 2 && tiny.get("a") == a,
+              "Cache evicts the least recently used entry");
+
+    Cache bounded(5, 4);
+    for (int i = 0; i < 40; ++i) {
+        bounded.get("x+" + std::to_string(i));
+    }
+    Cache::Stats boundedStats = bounded.stats();
+    Cache roomy(40, 4);
+    for (int i = 0; i < 40; ++i) {
+        roomy.get("x+" + std::to_string(i));
+    }
+    checkTest(boundedStats.size == 5 && boundedStats.evictions == 35 &&
+              roomy.stats().evictions == 0,
+              "Cache enforces its total capacity across shards");
+}
+
+void testPolynomial() {
+    using E = Expression<double>;
+    using P = Polynomial<double>;
+
+    E cubic = E::parse("2*x^3 + 3*x - 5");
+    auto poly = P::fromExpression(cubic);
+    checkTest(poly && poly->degree("x") == 3 && poly->termCount() == 3,
+              "Polynomial detection of 2*x^3 + 3*x - 5");
+
+    std::map<std::string, double> at = {{"x", 1.7}};
+    checkTest(poly && std::fabs(poly->evaluate(at) - cubic.evaluate(at)) < 1e-9,
+              "Polynomial Horner evaluation matches tree evaluation");
+
+    P dPoly = poly->differentiate("x");
+    checkTest(std::fabs(dPoly.evaluate(at) - (6 * 1.7 * 1.7 + 3)) < 1e-9 &&
+              dPoly.degree("x") == 2,
+              "Polynomial differentiation shifts coefficients");
+
+    E multi = E::parse("(x*y + 1)^3 / 2 - y^2");
+    auto mPoly = P::fromExpression(multi);
+    std::map<std::string, double> at2 = {{"x", 0.3}, {"y", -1.2}};
+    checkTest(mPoly && std::fabs(mPoly->evaluate(at2) - multi.evaluate(at2)) < 1e-9,
+              "Multivariate polynomial evaluation matches tree evaluation");
+
+    std::vector<double> xs, ys;
+    for (int i = 0; i < 1000; ++i) {
+        xs.push_back(-2.0 + 0.004 * i);
+        ys.push_back(1.0 - 0.003 * i);
+    }
+    std::vector<double> out;
+    mPoly->evaluateBatch({{"x", xs}, {"y", ys}}, out);
+    bool batchOk = out.size() == xs.size();
+    for (std::size_t i = 0; batchOk && i < xs.size(); ++i) {
+        std::map<std::string, double> pt = {{"x", xs[i]}, {"y", ys[i]}};
+        batchOk = std::fabs(out[i] - multi.evaluate(pt)) < 1e-9;
+    }
+    checkTest(batchOk, "Polynomial batch evaluation matches tree evaluation");
+
+    checkTest(!P::fromExpression(E::parse("sin(x) + x")) &&
+              !P::fromExpression(E::parse("x^0.5")) &&
+              !P::fromExpression(E::parse("1/x")),
+              "Non-polynomial expressions are rejected");
+
+    auto back = P::fromExpression(poly->toExpression());
+    checkTest(back && back->coefficients() == poly->coefficients(),
+              "Polynomial round-trips through toExpression");
+
+    // Expanding (x - a)^n into monomials cancels catastrophically near the
+    // root, so high powers of sums must stay factored.
+    E nearRoot = E::parse("(x - 1.5)^20 * y - 3*(x - 1.5)^19 * y");
+    auto rootPoly = P::fromExpression(nearRoot);
+    bool rootOk = (bool)rootPoly;
+    for (double x : {1.5 + 1e-3, 1.5 - 2e-4, 1.5 + 3e-6}) {
+        std::map<std::string, double> pt = {{"x", x}, {"y", 0.75}};
+        double tree = nearRoot.evaluate(pt);
+        rootOk = rootOk && std::fabs(rootPoly->evaluate(pt) - tree) <= 1e-12 * std::fabs(tree);
+        if (!rootOk) {
+            break;
+        }
+        P dRoot = rootPoly->differentiate("x");
+        double dTree = nearRoot.differentiate("x").evaluate(pt);
+        rootOk = rootOk && std::fabs(dRoot.evaluate(pt) - dTree) <= 1e-12 * std::fabs(dTree);
+    }
+    checkTest(rootOk, "Polynomial matches tree evaluation near a root of (x - a)^n");
+
+    // Low powers of sums are still expanded when added to other terms.
+    bool sumsOk = true;
+    for (const char *text : {"(x + 1)^3 + 1", "(x + y)^3 + x", "2*(x - y)^8 - (x + 1)^5*y"}) {
+        E sumExpr = E::parse(text);
+        auto sumPoly = P::fromExpression(sumExpr);
+        std::map<std::string, double> pt = {{"x", 0.6}, {"y", -1.4}};
+        sumsOk = sumsOk && sumPoly &&
+                 std::fabs(sumPoly->evaluate(pt) - sumExpr.evaluate(pt)) <= 1e-9 * std::fabs(sumExpr.evaluate(pt));
+    }
+    checkTest(sumsOk && !P::fromExpression(E::parse("(x - 1)^20 + 1")),
+              "Polynomial expands low powers of sums and rejects high ones");
+
+    auto huge = P::fromExpression(E::parse("(x + 1)^1100"));
+    std::map<std::string, double> nearMinusOne = {{"x", -0.999}};
+    checkTest(huge && huge->evaluate(nearMinusOne) == E::parse("(x + 1)^1100").evaluate(nearMinusOne) &&
+              !P::fromExpression(E::parse("(1e200*x)^2")),
+              "Polynomial keeps high powers finite and rejects overflowing coefficients");
+}
+
+void testCompiledExpression() {
+    using E = Expression<double>;
+    using C = CompiledExpression<double>;
+
+    const std::vector<std::string> sources = {
+        "x^5 - 3*x^2 / 4 + x^(-2)",
+        "sin(x*y) * cos(x*y) + exp(ln(x)) + ln(exp(y))",
+        "(x + y)^2.5 / (1 + x^2)",
+        "2 * 3 + x / (4 - 2*2 + 1)",
+    };
+    std::map<std::string, double> at = {{"x", 1.3}, {"y", 0.7}};
+    bool allMatch = true;
+    for (const auto& src : sources) {
+        E expr = E::parse(src);
+        C compiled(expr);
+        allMatch = allMatch && std::fabs(compiled.evaluate(at) - expr.evaluate(at)) < 1e-9;
+    }
+    checkTest(allMatch, "Compiled evaluation matches tree evaluation");
+
+    C powers(E::parse("x^5 / 4 + x^(-3)"));
+    checkTest(powers.countOps(C::Op::Pow) == 0 && powers.countOps(C::Op::Div) == 0 &&
+              powers.countOps(C::Op::MulConst) == 1 && powers.countOps(C::Op::Recip) == 1,
+              "Integer powers and constant divisors are strength-reduced");
+
+    C identities(E::parse("exp(ln(x)) + ln(exp(y))"));
+    checkTest(identities.countOps(C::Op::Exp) == 0 && identities.countOps(C::Op::Ln) == 0,
+              "exp(ln u) and ln(exp u) are lowered to u");
+
+    E trig = E::parse("sin(x) * x");
+    C dTrig(trig.differentiate("x").differentiate("x"));
+    checkTest(dTrig.countOps(C::Op::SinCos) == 1 && dTrig.countOps(C::Op::Sin) == 0 &&
+              dTrig.countOps(C::Op::Cos) == 0,
+              "sin(u) and cos(u) over the same u are fused");
+
+    E batchExpr = E::parse("sin(x) / (1 + y^2) - cos(x) * 3");
+    C batch(batchExpr);
+    std::vector<double> xs, ys, out;
+    for (int i = 0; i < 1000; ++i) {
+        xs.push_back(0.01 * i);
+        ys.push_back(2.0 - 0.002 * i);
+    }
+    batch.evaluateBatch({{"x", xs}, {"y", ys}}, out);
+    bool batchOk = out.size() == xs.size();
+    for (std::size_t i = 0; batchOk && i < xs.size(); ++i) {
+        std::map<std::string, double> pt = {{"x", xs[i]}, {"y", ys[i]}};
+        batchOk = std::fabs(out[i] - batchExpr.evaluate(pt)) < 1e-9;
+    }
+    checkTest(batchOk, "Compiled batch evaluation matches tree evaluation");
+
+    bool threwDiv = false, threwLn = false;
+    try {
+        C(E::parse("1 / (x - 1)")).evaluate({{"x", 1.0}});
+    } catch (const std::runtime_error&) {
+        threwDiv = true;
+    }
+    try {
+        C(E::parse("exp(ln(x))")).evaluate({{"x", -2.0}});
+    } catch (const std::runtime_error&) {
+        threwLn = true;
+    }
+    checkTest(threwDiv && threwLn, "Compiled evaluation keeps division and ln errors");
+
+    // Each constant node is folded once, so a deeply shared DAG and a long
+    // chain above a failing constant both compile quickly.
+    E shared = cos(E(0.5));
+    for (int i = 0; i < 60; ++i) {
+        shared = shared * shared + E(-0.5);
+    }
+    E failing = E(1.0) / E(0.0);
+    for (int i = 0; i < 2000; ++i) {
+        failing = failing + E((double)i);
+    }
+    bool threwFolded = false;
+    try {
+        C(failing * E("x")).evaluate({{"x", 1.0}});
+    } catch (const std::runtime_error&) {
+        threwFolded = true;
+    }
+    C sharedCompiled(shared * E("x"));
+    checkTest(sharedCompiled.countOps(C::Op::Const) == 1 && threwFolded,
+              "Compiled constant folding handles shared and failing subtrees");
+}
+
+void testTaylorDerivatives() {
+    using E = Expression<double>;
+
+    std::vector<double> expAt0 = E::parse("exp(x)").taylorDerivatives("x", 0.0, 20);
+    bool expOk = expAt0.size() == 21;
+    for (double d : expAt0) {
+        expOk = expOk && std::fabs(d - 1.0) < 1e-9;
+    }
+    checkTest(expOk, "Taylor derivatives of exp(x) at 0 are all 1");
+
+    std::vector<double> sinAt0 = E::parse("sin(2*x)").taylorDerivatives("x", 0.0, 12);
+    bool sinOk = true;
+    for (std::size_t k = 0; k <= 12; ++k) {
+        double expected = (k % 2 == 0) ? 0.0 : std::pow(2.0, (double)k) * ((k % 4 == 1) ? 1.0 : -1.0);
+        sinOk = sinOk && std::fabs(sinAt0[k] - expected) < 1e-6 * std::max(1.0, std::fabs(expected));
+    }
+    checkTest(sinOk, "Taylor derivatives of sin(2*x) at 0 alternate as powers of 2");
+
+    const std::vector<std::string> sources = {
+        "sin(x) / (1 + x^2)", "ln(x) * x^2.5 - cos(x*y)", "x^x + exp(y/x)", "(x - 1)^3 * y"};
+    std::map<std::string, double> at = {{"x", 1.3}, {"y", 0.5}};
+    bool symbolicOk = true;
+    for (const auto& src : sources) {
+        E expr = E::parse(src);
+        std::vector<double> taylor = expr.taylorDerivatives("x", 1.3, 4, {{"y", 0.5}});
+        E d = expr;
+        for (std::size_t k = 0; k <= 4; ++k) {
+            double symbolic = d.evaluate(at);
+            symbolicOk = symbolicOk && std::fabs(taylor[k] - symbolic) < 1e-7 * std::max(1.0, std::fabs(symbolic));
+            d = d.differentiate("x");
+        }
+    }
+    checkTest(symbolicOk, "Taylor derivatives match repeated symbolic differentiation");
+
+    std::vector<double> cubeAt1 = E::parse("(x - 1)^3 * y").taylorDerivatives("x", 1.0, 5, {{"y", 0.5}});
+    checkTest(cubeAt1 == std::vector<double>({0.0, 0.0, 0.0, 3.0, 0.0, 0.0}),
+              "Taylor derivatives of an integer power of a zero base");
+
+    std::vector<double> hugePower = E::parse("x^1e300 + x^7").taylorCoefficients("x", 0.0, 4);
+    checkTest(hugePower == std::vector<double>(5, 0.0),
+              "Taylor powers of a zero base above the order vanish");
+
+    std::vector<double> coeffs = E::parse("1 / (1 - x)").taylorCoefficients("x", 0.0, 25);
+    bool geometricOk = true;
+    for (double c : coeffs) {
+        geometricOk = geometricOk && std::fabs(c - 1.0) < 1e-12;
+    }
+    checkTest(geometricOk, "Taylor coefficients of 1/(1-x) at 0 are all 1");
+
+    bool threw = false;
+    try {
+        E::parse("ln(x)").taylorDerivatives("x", -1.0, 3);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    checkTest(threw, "Taylor expansion reports ln domain errors");
+}
+
+void testSharedString() {
+    using E = Expression<double>;
+
+    E x("x");
+    E s = sin(x);
+    checkTest((s * s).toSharedString() == "t1 = sin(x);\nresult = (t1 * t1)",
+              "Shared subexpression printed once as a temporary");
+
+    checkTest((x + E(2.0)).toSharedString() == "result = (x + 2)",
+              "Expression without sharing prints as plain result");
+
+    E t1("t1");
+    E clash = sin(t1) * sin(t1);
+    E st1 = sin(t1);
+    checkTest((st1 * st1 + t1).toSharedString() == "t2 = sin(t1);\nresult = ((t2 * t2) + t1)" &&
+              clash.toSharedString() == "result = (sin(t1) * sin(t1))",
+              "Shared temporaries skip the names of variables");
+
+    E f = x;
+    for (int i = 0; i < 12; ++i) {
+        f = f / (f + x);
+    }
+    E df = f.differentiate("x");
+    std::string shared = df.toSharedString();
+    std::string expanded = df.toString();
+    checkTest(shared.size() * 100 < expanded.size(),
+              "Shared printing of nested quotient derivative stays small");
+
+    // Differentiation memoises only nodes with several owners, so a plain
+    // tree never touches the memo.
+    using Node = ExprNode<double>;
+    auto sum = std::make_shared<Node>(ExprType::Add,
+                                      std::make_shared<Node>(ExprType::Variable, std::string("x")),
+                                      std::make_shared<Node>(ExprType::Constant, 2.0));
+    bool treeUnshared = !Node::isShared(sum->left) && !Node::isShared(sum->right);
+    auto square = std::make_shared<Node>(ExprType::Mul, sum, sum);
+    checkTest(treeUnshared && Node::isShared(square->left) &&
+              E(square).differentiate("x").toString() == "((1 * (x + 2)) + ((x + 2) * 1))",
+              "Only nodes reachable twice are memoised when differentiating");
+}
+
+void testNoThrowEvaluation() {
+    using E = Expression<double>;
+    using C = CompiledExpression<double>;
+
+    C compiled(E::parse("ln(x) + 1 / (y - 2)"));
+    std::vector<double> xs = {1.0, -1.0, 2.0, 0.0, 3.0};
+    std::vector<double> ys = {1.0, 1.0, 2.0, 2.0, 5.0};
+    std::vector<double> out;
+    EvalErrors errors;
+    compiled.evaluateBatchNoThrow({{"x", xs}, {"y", ys}}, out, errors);
+
+    bool valuesOk = std::fabs(out[0] - (std::log(1.0) - 1.0)) < 1e-12 &&
+                    std::isnan(out[1]) && std::isinf(out[2]) &&
+                    std::fabs(out[4] - (std::log(3.0) + 1.0 / 3.0)) < 1e-12;
+    checkTest(valuesOk, "No-throw evaluation follows IEEE semantics");
+
+    bool codesOk = errors.failedCount == 3 && errors.codes[0] == 0 &&
+                   hasError(errors.codes[1], EvalError::LnDomain) &&
+                   hasError(errors.codes[2], EvalError::DivisionByZero) &&
+                   hasError(errors.codes[3], EvalError::LnDomain) &&
+                   hasError(errors.codes[3], EvalError::DivisionByZero) &&
+                   !errors.failed(0) && errors.failed(1) && !errors.failed(4) &&
+                   errors.mask[0] == 0xEu;
+    checkTest(codesOk, "No-throw evaluation records per-lane error codes and mask");
+
+    std::vector<double> guarded;
+    EvalErrors guardedErrors;
+    compiled.evaluateBatchNoThrow({{"x", xs}, {"y", ys}}, guarded, guardedErrors, -1.0);
+    checkTest(guarded[1] == -1.0 && guarded[2] == -1.0 && guarded[3] == -1.0 &&
+              guarded[0] == out[0],
+              "No-throw evaluation writes the sentinel for failed lanes");
+
+    std::vector<double> missingOut;
+    EvalErrors missingErrors;
+    compiled.evaluateBatchNoThrow({{"x", xs}}, missingOut, missingErrors);
+    checkTest(missingErrors.failedCount == xs.size() &&
+              hasError(missingErrors.codes[0], EvalError::MissingVariable) &&
+              std::isnan(missingOut[0]),
+              "No-throw evaluation flags missing variables");
+
+    std::map<std::string, std::vector<double>> extraColumn = {{"a", {1.0, 2.0}}, {"x", {1.0, 2.0, 3.0}}};
+    std::vector<double> extraOut, extraPolyOut, extraThrowOut;
+    EvalErrors extraErrors;
+    C doubled(E::parse("x*2"));
+    doubled.evaluateBatchNoThrow(extraColumn, extraOut, extraErrors);
+    doubled.evaluateBatch(extraColumn, extraThrowOut);
+    Polynomial<double>::fromExpression(E::parse("x*2"))->evaluateBatch(extraColumn, extraPolyOut);
+    checkTest(extraOut == std::vector<double>{2.0, 4.0, 6.0} && extraErrors.failedCount == 0 &&
+              extraThrowOut == extraOut && extraPolyOut == extraOut,
+              "Batch evaluation ignores columns the expression does not read");
+
+    std::vector<double> big(1000, 4.0);
+    big[777] = -4.0;
+    std::vector<double> bigOut;
+    EvalErrors bigErrors;
+    C(E::parse("exp(ln(x))")).evaluateBatchNoThrow({{"x", big}}, bigOut, bigErrors);
+    checkTest(bigErrors.failedCount == 1 && bigErrors.failed(777) &&
+              std::isnan(bigOut[777]) && bigOut[776] == 4.0,
+              "No-throw evaluation isolates the bad lane across blocks");
+}
+
+void testSubstituteFolding() {
+    using E = Expression<double>;
+
+    checkTest(E::parse("2*3 + x").substitute("x", 1.0).toString() == "7",
+              "Substitution folds the fully numeric result");
+
+    E model = E::parse("a*x^2 + b*x + c");
+    E specialized = model.substitute(std::map<std::string, double>{{"a", 2.0}, {"b", -1.0}, {"c", 0.5}});
+    checkTest(specialized.toString() == "((2 * (x^2)) + ((-1 * x) + 0.5))",
+              "Substitution binds several variables in one pass");
+
+    E x("x"), y("y"), z("z");
+    E shared = sin(y) * cos(z);
+    E big = shared * x + shared;
+    E partial = big.substitute("x", 2.0);
+    checkTest(partial.toSharedString() == "t1 = (sin(y) * cos(z));\nresult = ((t1 * 2) + t1)",
+              "Substitution shares subtrees without the bound variable");
+
+    E pole = E::parse("1 / (x - 1)").substitute("x", 1.0);
+    bool threw = false;
+    try {
+        pole.evaluate();
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    checkTest(threw && pole.toString() == "(1 / 0)",
+              "Substitution keeps operations that would throw");
+}
+
+template <typename T>
+double ulpDistance(T value, T reference) {
+    if (value == reference || (std::isnan(value) && std::isnan(reference))) {
+        return 0.0;
+    }
+    if (!std::isfinite(value) || !std::isfinite(reference)) {
+        return std::numeric_limits<double>::infinity();
+    }
+    T magnitude = std::fabs(reference);
+    T ulp = std::nextafter(magnitude, std::numeric_limits<T>::infinity()) - magnitude;
+    return std::fabs((double)value - (double)reference) / (double)ulp;
+}
+
+template <typename T>
+double maxUlpError(void (*kernel)(const T*, T*, std::size_t), T (*reference)(T),
+                   double lo, double hi, bool logScale) {
+    std::mt19937_64 rng(12345);
+    std::uniform_real_distribution<double> dist(lo, hi);
+    std::vector<T> in(1 << 18), out(in.size());
+    for (auto& v : in) {
+        v = (T)(logScale ? std::exp(dist(rng)) : dist(rng));
+    }
+    kernel(in.data(), out.data(), in.size());
+    double worst = 0.0;
+    for (std::size_t i = 0; i < in.size(); ++i) {
+        worst = std::max(worst, ulpDistance(out[i], reference(in[i])));
+    }
+    return worst;
+}
+
+template <typename T> T libmSin(T v) { return std::sin(v); }
+template <typename T> T libmCos(T v) { return std::cos(v); }
+template <typename T> T libmExp(T v) { return std::exp(v); }
+template <typename T> T libmLog(T v) { return std::log(v); }
+
+template <typename T>
+bool simdKernelsAccurate(double trigRange, double expLo, double expHi) {
+    return maxUlpError<T>(simd_math::sin<T>, libmSin<T>, -trigRange, trigRange, false) <= 2.0 &&
+           maxUlpError<T>(simd_math::cos<T>, libmCos<T>, -trigRange, trigRange, false) <= 2.0 &&
+           maxUlpError<T>(simd_math::exp<T>, libmExp<T>, expLo, expHi, false) <= 2.0 &&
+           maxUlpError<T>(simd_math::log<T>, libmLog<T>, expLo, expHi, true) <= 2.0;
+}
+
+void testSimdMath() {
+    using simd_math::Level;
+
+    bool doubleOk = true, floatOk = true;
+    for (Level level : {Level::SSE2, Level::AVX2, Level::AVX512}) {
+        if (level > simd_math::supportedLevel()) {
+            continue;
+        }
+        simd_math::setLevel(level);
+        doubleOk = doubleOk && simdKernelsAccurate<double>(2.0e5, -745.0, 709.0);
+        floatOk = floatOk && simdKernelsAccurate<float>(2.0e3, -103.0, 88.0);
+    }
+    simd_math::setLevel(simd_math::supportedLevel());
+    checkTest(doubleOk, "SIMD sin/cos/exp/ln (double) within 2 ulp of libm");
+    checkTest(floatOk, "SIMD sin/cos/exp/ln (float) within 2 ulp of libm");
+
+    double special[] = {0.0, -0.0, INFINITY, -INFINITY, NAN, -1.0};
+    double logOut[6], expOut[6], sinOut[6];
+    simd_math::log(special, logOut, 6);
+    simd_math::exp(special, expOut, 6);
+    simd_math::sin(special, sinOut, 6);
+    checkTest(std::isinf(logOut[0]) && logOut[0] < 0 && std::isinf(logOut[2]) &&
+              std::isnan(logOut[3]) && std::isnan(logOut[4]) && std::isnan(logOut[5]) &&
+              expOut[0] == 1.0 && std::isinf(expOut[2]) && expOut[3] == 0.0 &&
+              std::isnan(expOut[4]) && sinOut[0] == 0.0 && std::isnan(sinOut[2]) &&
+              std::isnan(sinOut[4]),
+              "SIMD kernels handle special values like libm");
+
+    using E = Expression<double>;
+    E trig = E::parse("sin(x) * cos(x) + exp(x / 4) - ln(x + 2)");
+    CompiledExpression<double> compiled(trig);
+    std::vector<double> xs(10000), out;
+    for (std::size_t i = 0; i < xs.size(); ++i) {
+        xs[i] = -1.5 + 0.001 * (double)i;
+    }
+    compiled.evaluateBatch({{"x", xs}}, out);
+    bool batchOk = true;
+    for (std::size_t i = 0; i < xs.size(); ++i) {
+        batchOk = batchOk && std::fabs(out[i] - trig.evaluate({{"x", xs[i]}})) < 1e-12;
+    }
+    checkTest(batchOk, "Compiled batch evaluation with SIMD kernels matches tree evaluation");
+}
+
+template <typename F>
+std::string errorMessage(F&& f) {
+    try {
+        f();
+    } catch (const std::runtime_error& e) {
+        return e.what();
+    }
+    return "";
+}
+
+void testParallelTraversal() {
+    using E = Expression<double>;
+
+    // A balanced sum of 512 distinct terms, so every level forks with a
+    // grain of 16 nodes.
+    std::vector<E> terms;
+    for (int i = 0; i < 512; ++i) {
+        E x("x"), y("y");
+        E c((double)(i % 7 + 1));
+        terms.push_back(i % 2 ? sin(c * x) * exp(y / c) : (x ^ c) / (y + c));
+    }
+    while (terms.size() > 1) {
+        std::vector<E> next;
+        for (std::size_t i = 0; i + 1 < terms.size(); i += 2) {
+            next.push_back(i % 4 ? terms[i] - terms[i + 1] : terms[i] + terms[i + 1]);
+        }
+        terms = next;
+    }
+    E big = terms[0];
+    std::map<std::string, double> values{{"x", 0.7}, {"y", 1.3}};
+
+    ForkJoinPool pool(4, 16);
+    checkTest(big.differentiate("x", pool).toString() == big.differentiate("x").toString(),
+              "Parallel differentiation matches the sequential result");
+    std::map<std::string, double> bindings{{"y", 2.0}};
+    checkTest(big.substitute(bindings, pool).toString() == big.substitute(bindings).toString(),
+              "Parallel substitution matches the sequential result");
+    checkTest(big.evaluate(values, pool) == big.evaluate(values),
+              "Parallel evaluation matches the sequential result");
+
+    E missing = big * E("z") + big / (E("x") - E(0.7));
+    E pole = big / (E("x") - E(0.7)) + big * E("z");
+    checkTest(errorMessage([&] { missing.evaluate(values, pool); }) ==
+                  errorMessage([&] { missing.evaluate(values); }) &&
+              errorMessage([&] { pole.evaluate(values, pool); }) ==
+                  errorMessage([&] { pole.evaluate(values); }),
+              "Parallel evaluation throws the same error as sequential evaluation");
+
+    // Left-folded and parsed sums have one small operand at every level, so
+    // they are split along the chain rather than at balanced forks.
+    E chain(0.0);
+    for (int i = 0; i < 512; ++i) {
+        E c((double)(i % 7 + 1));
+        E term = i % 2 ? sin(c * E("x")) * exp(E("y") / c) : (E("x") ^ c) / (E("y") + c);
+        if (i == 200) {
+            term = term * E("z");
+        }
+        if (i == 300) {
+            term = term / (E("x") - E(0.7));
+        }
+        chain = chain + term;
+    }
+    std::string text = "x";
+    for (int i = 0; i < 512; ++i) {
+        text += (i % 3 ? " + " : " - ") + std::to_string(i % 5 + 1) + "*sin(x*y)";
+    }
+    E parsed = E::parse(text);
+    std::map<std::string, double> allValues{{"x", 0.7}, {"y", 1.3}, {"z", 2.0}};
+    checkTest(chain.differentiate("x", pool).toString() == chain.differentiate("x").toString() &&
+                  parsed.differentiate("x", pool).toString() ==
+                      parsed.differentiate("x").toString(),
+              "Parallel differentiation of a chain matches the sequential result");
+    checkTest(chain.substitute(bindings, pool).toString() ==
+                  chain.substitute(bindings).toString() &&
+                  parsed.substitute(bindings, pool).toString() ==
+                      parsed.substitute(bindings).toString(),
+              "Parallel substitution of a chain matches the sequential result");
+    allValues["x"] = 0.5;
+    checkTest(chain.evaluate(allValues, pool) == chain.evaluate(allValues) &&
+                  parsed.evaluate(values, pool) == parsed.evaluate(values),
+              "Parallel evaluation of a chain matches the sequential result");
+    allValues["x"] = 0.7;
+    checkTest(errorMessage([&] { chain.evaluate(allValues, pool); }) ==
+                  errorMessage([&] { chain.evaluate(allValues); }) &&
+              errorMessage([&] { chain.evaluate(values, pool); }) ==
+                  errorMessage([&] { chain.evaluate(values); }),
+              "Parallel evaluation of a chain throws the same error as sequential evaluation");
+
+    // Unary nodes on the path have no second operand to process.
+    E nested("x");
+    for (int i = 0; i < 200; ++i) {
+        nested = i % 3 ? sin(nested) : exp(nested) * E(0.5);
+    }
+    checkTest(nested.evaluate(values, pool) == nested.evaluate(values) &&
+                  nested.differentiate("x", pool).toString() ==
+                      nested.differentiate("x").toString() &&
+                  nested.substitute(bindings, pool).toString() ==
+                      nested.substitute(bindings).toString(),
+              "Parallel traversal of nested unary functions matches the sequential result");
+}
+
 int runAllTests() {
 
     g_totalTests = 0;
@@ -173,6 +816,16 @@ int runAllTests() {
     testToString();
     testParsing();
     testDifferentiation();
+    testDependencyAwareDifferentiation();
+    testExpressionCache();
+    testPolynomial();
+    testCompiledExpression();
+    testTaylorDerivatives();
+    testSharedString();
+    testNoThrowEvaluation();
+    testSubstituteFolding();
+    testSimdMath();
+    testParallelTraversal();
 
     std::cout << "==== Tests Complete ====\n";
     std::cout << "Total tests: " << g_totalTests << "\n";